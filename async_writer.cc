@@ -0,0 +1,319 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "async_writer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef USE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+using std::deque;
+using std::max;
+using std::string;
+using std::thread;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// Number of threads used by ThreadPoolFileWriter.
+static const int kNumWriterThreads = 2;
+
+#ifdef USE_LIBURING
+// Number of entries in the io_uring submission queue.
+static const unsigned int kUringQueueDepth = 64;
+#endif
+
+uint64_t GetMonotonicTimeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// A buffer being written to the file.
+struct WriteRequest {
+  string data;
+  uint64_t offset;          // file offset of the start of |data|
+  size_t bytes_written;
+  uint64_t queue_time_us;
+};
+
+void RecordQueued(int queue_depth, AsyncWriteStats* stats) {
+  stats->total_queue_depth += queue_depth;
+  stats->max_queue_depth = max(stats->max_queue_depth, queue_depth);
+}
+
+void RecordCompleted(const WriteRequest& request, AsyncWriteStats* stats) {
+  const uint64_t latency_us = GetMonotonicTimeUs() - request.queue_time_us;
+  stats->num_writes++;
+  stats->total_latency_us += latency_us;
+  stats->max_latency_us = max(stats->max_latency_us, latency_us);
+}
+
+// Performs blocking pwrite() calls on a pool of threads.
+class ThreadPoolFileWriter : public AsyncFileWriter {
+ public:
+  ThreadPoolFileWriter(int fd, size_t max_in_flight_bytes)
+      : fd_(fd),
+        max_in_flight_bytes_(max_in_flight_bytes),
+        next_offset_(0),
+        in_flight_bytes_(0),
+        num_in_flight_(0),
+        failed_(false),
+        shutting_down_(false) {
+    for (int i = 0; i < kNumWriterThreads; ++i)
+      threads_.push_back(thread(&ThreadPoolFileWriter::Run, this));
+  }
+
+  virtual ~ThreadPoolFileWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutting_down_ = true;
+      cond_.notify_all();
+    }
+    for (size_t i = 0; i < threads_.size(); ++i)
+      threads_[i].join();
+  }
+
+  virtual void Write(string* data) {
+    WriteRequest* request = new WriteRequest;
+    request->data.swap(*data);
+    request->offset = next_offset_;
+    request->bytes_written = 0;
+    next_offset_ += request->data.size();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this, request] {
+      return in_flight_bytes_ == 0 ||
+             in_flight_bytes_ + request->data.size() <= max_in_flight_bytes_;
+    });
+    request->queue_time_us = GetMonotonicTimeUs();
+    in_flight_bytes_ += request->data.size();
+    num_in_flight_++;
+    RecordQueued(num_in_flight_, &stats_);
+    pending_.push_back(request);
+    cond_.notify_all();
+  }
+
+  virtual bool Finish() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return num_in_flight_ == 0; });
+    return !failed_;
+  }
+
+ private:
+  void Run() {
+    while (true) {
+      WriteRequest* request = NULL;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] {
+          return shutting_down_ || !pending_.empty();
+        });
+        if (pending_.empty())
+          return;
+        request = pending_.front();
+        pending_.pop_front();
+      }
+
+      bool success = true;
+      while (request->bytes_written < request->data.size()) {
+        const ssize_t result =
+            pwrite(fd_,
+                   request->data.data() + request->bytes_written,
+                   request->data.size() - request->bytes_written,
+                   request->offset + request->bytes_written);
+        if (result < 0 && errno == EINTR)
+          continue;
+        if (result <= 0) {
+          PLOG(ERROR) << "Write failed";
+          success = false;
+          break;
+        }
+        request->bytes_written += result;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!success)
+        failed_ = true;
+      RecordCompleted(*request, &stats_);
+      in_flight_bytes_ -= request->data.size();
+      num_in_flight_--;
+      delete request;
+      cond_.notify_all();
+    }
+  }
+
+  const int fd_;
+  const size_t max_in_flight_bytes_;
+  uint64_t next_offset_;
+
+  // Protects the members below.
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  deque<WriteRequest*> pending_;  // queued but not yet started
+  size_t in_flight_bytes_;
+  int num_in_flight_;
+  bool failed_;
+  bool shutting_down_;
+
+  vector<thread> threads_;
+};
+
+#ifdef USE_LIBURING
+// Submits writes to an io_uring and reaps their completions from the calling
+// thread.
+class UringFileWriter : public AsyncFileWriter {
+ public:
+  UringFileWriter(int fd, size_t max_in_flight_bytes)
+      : fd_(fd),
+        max_in_flight_bytes_(max_in_flight_bytes),
+        next_offset_(0),
+        in_flight_bytes_(0),
+        num_in_flight_(0),
+        failed_(false),
+        initialized_(false) {
+  }
+
+  virtual ~UringFileWriter() {
+    if (initialized_) {
+      Finish();
+      io_uring_queue_exit(&ring_);
+    }
+  }
+
+  // Returns false if the kernel doesn't support io_uring.
+  bool Init() {
+    const int result = io_uring_queue_init(kUringQueueDepth, &ring_, 0);
+    if (result < 0) {
+      LOG(WARNING) << "Unable to initialize io_uring: " << strerror(-result);
+      return false;
+    }
+    initialized_ = true;
+    return true;
+  }
+
+  virtual void Write(string* data) {
+    // Collect anything that's already done, and then wait for more if
+    // needed to keep within our limits.
+    while (num_in_flight_ > 0 && ReapCompletion(false)) {}
+    while (num_in_flight_ > 0 &&
+           (num_in_flight_ >= static_cast<int>(kUringQueueDepth) ||
+            in_flight_bytes_ + data->size() > max_in_flight_bytes_)) {
+      ReapCompletion(true);
+    }
+
+    WriteRequest* request = new WriteRequest;
+    request->data.swap(*data);
+    request->offset = next_offset_;
+    request->bytes_written = 0;
+    request->queue_time_us = GetMonotonicTimeUs();
+    next_offset_ += request->data.size();
+    in_flight_bytes_ += request->data.size();
+    num_in_flight_++;
+    RecordQueued(num_in_flight_, &stats_);
+    Submit(request);
+  }
+
+  virtual bool Finish() {
+    while (num_in_flight_ > 0)
+      ReapCompletion(true);
+    return !failed_;
+  }
+
+ private:
+  // Submits the unwritten part of |request|.
+  void Submit(WriteRequest* request) {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+    CHECK(sqe) << "io_uring submission queue is full";
+    io_uring_prep_write(sqe, fd_,
+                        request->data.data() + request->bytes_written,
+                        request->data.size() - request->bytes_written,
+                        request->offset + request->bytes_written);
+    io_uring_sqe_set_data(sqe, request);
+    const int result = io_uring_submit(&ring_);
+    CHECK(result >= 0) << "io_uring_submit() failed: " << strerror(-result);
+  }
+
+  // Handles a single completion, waiting for one if |wait| is true.
+  // Returns false if none was available.
+  bool ReapCompletion(bool wait) {
+    struct io_uring_cqe* cqe = NULL;
+    const int result = wait ? io_uring_wait_cqe(&ring_, &cqe) :
+                              io_uring_peek_cqe(&ring_, &cqe);
+    if (result < 0 || !cqe)
+      return false;
+
+    WriteRequest* request =
+        static_cast<WriteRequest*>(io_uring_cqe_get_data(cqe));
+    const int written = cqe->res;
+    io_uring_cqe_seen(&ring_, cqe);
+
+    if (written == -EINTR || written == -EAGAIN) {
+      Submit(request);
+      return true;
+    }
+    if (written <= 0) {
+      LOG(ERROR) << "Write failed: " << strerror(-written);
+      failed_ = true;
+    } else {
+      request->bytes_written += written;
+      if (request->bytes_written < request->data.size()) {
+        // Short write; submit the rest.
+        Submit(request);
+        return true;
+      }
+    }
+
+    RecordCompleted(*request, &stats_);
+    in_flight_bytes_ -= request->data.size();
+    num_in_flight_--;
+    delete request;
+    return true;
+  }
+
+  const int fd_;
+  const size_t max_in_flight_bytes_;
+  struct io_uring ring_;
+  uint64_t next_offset_;
+  size_t in_flight_bytes_;
+  int num_in_flight_;
+  bool failed_;
+  bool initialized_;
+};
+#endif  // USE_LIBURING
+
+}  // namespace
+
+// static
+AsyncFileWriter* AsyncFileWriter::Create(int fd, size_t max_in_flight_bytes) {
+#ifdef USE_LIBURING
+  UringFileWriter* writer = new UringFileWriter(fd, max_in_flight_bytes);
+  if (writer->Init())
+    return writer;
+  delete writer;
+#endif
+  return new ThreadPoolFileWriter(fd, max_in_flight_bytes);
+}
+
+}  // namespace screenshot
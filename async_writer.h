@@ -0,0 +1,69 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_ASYNC_WRITER_H_
+#define SCREENSHOT_ASYNC_WRITER_H_
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+
+namespace screenshot {
+
+// Statistics about the writes performed by an AsyncFileWriter.
+struct AsyncWriteStats {
+  AsyncWriteStats()
+      : num_writes(0),
+        total_queue_depth(0),
+        max_queue_depth(0),
+        total_latency_us(0),
+        max_latency_us(0) {
+  }
+
+  int num_writes;
+
+  // Number of writes that were outstanding when each write was queued
+  // (including that write).
+  uint64_t total_queue_depth;
+  int max_queue_depth;
+
+  // Time from each write being queued until it completed.
+  uint64_t total_latency_us;
+  uint64_t max_latency_us;
+};
+
+// Appends buffers to a file without blocking the caller on each write, so
+// that a thread producing data at a high rate isn't stalled by the disk.
+// Writes are performed with io_uring when built with USE_LIBURING and
+// supported by the kernel, and by a small pool of threads otherwise.
+//
+// At most |max_in_flight_bytes| bytes may be queued at once; Write() blocks
+// until earlier writes complete if more would be needed.  Methods must not
+// be called concurrently, and stats() is only complete after Finish().
+class AsyncFileWriter {
+ public:
+  // Creates a writer appending to |fd|, which remains owned by the caller.
+  static AsyncFileWriter* Create(int fd, size_t max_in_flight_bytes);
+
+  virtual ~AsyncFileWriter() {}
+
+  const AsyncWriteStats& stats() const { return stats_; }
+
+  // Queues the contents of |data| to be appended to the file.  |data| is
+  // swapped into the writer and left empty.
+  virtual void Write(std::string* data) = 0;
+
+  // Waits for all queued writes to complete.  Returns false if any failed.
+  virtual bool Finish() = 0;
+
+ protected:
+  AsyncFileWriter() {}
+
+  AsyncWriteStats stats_;
+};
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_ASYNC_WRITER_H_
@@ -0,0 +1,282 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "capture_pool.h"
+
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <algorithm>
+
+#include <X11/extensions/XShm.h>
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+using std::lock_guard;
+using std::mutex;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// Size of huge pages, which SHM_HUGETLB segments must be a multiple of.
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+// Maximum number of unused buffers to keep.  When a new buffer is needed
+// and there are already this many, the least-recently released ones are
+// destroyed.
+static const size_t kMaxFreeBuffers = 4;
+
+// Set by HandleShmAttachError().
+bool g_shm_attach_failed = false;
+
+// X error handler installed while attaching a shared memory segment, which
+// fails (asynchronously) on displays that don't share our host.
+int HandleShmAttachError(Display* display, XErrorEvent* event) {
+  g_shm_attach_failed = true;
+  return 0;
+}
+
+// Returns the number of bytes needed for a |width|x|height| shm image.
+size_t GetShmImageSize(Display* display, Visual* visual, int depth,
+                       unsigned int width, unsigned int height) {
+  XImage* image = XShmCreateImage(display, visual, depth, ZPixmap, NULL,
+                                  NULL, width, height);
+  if (!image)
+    return 0;
+  const size_t size =
+      static_cast<size_t>(image->bytes_per_line) * image->height;
+  XDestroyImage(image);
+  return size;
+}
+
+}  // namespace
+
+struct CapturePool::Buffer {
+  XImage* image;
+  Visual* visual;
+  XShmSegmentInfo shm_info;
+  size_t size;  // of the segment, which may be bigger than |image| needs
+};
+
+CapturePool::CapturePool(Display* display, bool use_huge_pages)
+    : display_(display),
+      use_shm_(XShmQueryExtension(display)),
+      use_huge_pages_(use_huge_pages),
+      last_win_(None),
+      last_visual_(NULL),
+      last_depth_(0),
+      num_hits_(0),
+      num_misses_(0) {
+  if (!use_shm_)
+    VLOG(1) << "MIT-SHM extension unavailable; not pooling captures";
+}
+
+CapturePool::~CapturePool() {
+  DCHECK(free_buffers_.size() == buffers_.size())
+      << "Destroying pool while images are still in use";
+  for (size_t i = 0; i < buffers_.size(); ++i)
+    DestroyBuffer(buffers_[i]);
+}
+
+XImage* CapturePool::Capture(Window win,
+                             int x, int y,
+                             unsigned int width, unsigned int height) {
+  if (use_shm_ && win != last_win_) {
+    XWindowAttributes attr;
+    if (!XGetWindowAttributes(display_, win, &attr))
+      return NULL;
+    last_win_ = win;
+    last_visual_ = attr.visual;
+    last_depth_ = attr.depth;
+  }
+
+  Buffer* buffer =
+      use_shm_ ? GetBuffer(last_visual_, last_depth_, width, height) : NULL;
+  if (!buffer) {
+    // Fall back to a regular (unpooled) request.
+    return XGetImage(display_, win, x, y, width, height, AllPlanes, ZPixmap);
+  }
+
+  if (!XShmGetImage(display_, win, buffer->image, x, y, AllPlanes)) {
+    Release(buffer->image);
+    return NULL;
+  }
+  return buffer->image;
+}
+
+void CapturePool::Release(XImage* image) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      if (buffers_[i]->image == image) {
+        free_buffers_.push_back(buffers_[i]);
+        return;
+      }
+    }
+  }
+  XDestroyImage(image);
+}
+
+CapturePool::Buffer* CapturePool::GetBuffer(Visual* visual, int depth,
+                                            unsigned int width,
+                                            unsigned int height) {
+  const size_t size =
+      GetShmImageSize(display_, visual, depth, width, height);
+  if (!size)
+    return NULL;
+
+  Buffer* reused = NULL;
+  vector<Buffer*> evicted;
+  {
+    lock_guard<mutex> lock(mutex_);
+    size_t best_index = 0;
+    for (size_t i = 0; i < free_buffers_.size(); ++i) {
+      Buffer* buffer = free_buffers_[i];
+      if (buffer->image->width == static_cast<int>(width) &&
+          buffer->image->height == static_cast<int>(height) &&
+          buffer->image->depth == depth && buffer->visual == visual) {
+        free_buffers_.erase(free_buffers_.begin() + i);
+        num_hits_++;
+        return buffer;
+      }
+      if (buffer->size >= size && (!reused || buffer->size < reused->size)) {
+        reused = buffer;
+        best_index = i;
+      }
+    }
+
+    if (reused) {
+      free_buffers_.erase(free_buffers_.begin() + best_index);
+    } else {
+      while (free_buffers_.size() >= kMaxFreeBuffers) {
+        Buffer* buffer = free_buffers_.front();
+        free_buffers_.erase(free_buffers_.begin());
+        buffers_.erase(std::find(buffers_.begin(), buffers_.end(), buffer));
+        evicted.push_back(buffer);
+      }
+    }
+  }
+
+  if (reused) {
+    // Put a new image header over the existing segment.  Release() reads
+    // every buffer's image on other threads, so swap it under the lock.
+    XImage* image = XShmCreateImage(display_, visual, depth, ZPixmap,
+                                    reused->shm_info.shmaddr,
+                                    &reused->shm_info, width, height);
+    CHECK(image);
+    XImage* old_image = NULL;
+    {
+      lock_guard<mutex> lock(mutex_);
+      old_image = reused->image;
+      reused->image = image;
+      reused->visual = visual;
+    }
+    old_image->data = NULL;
+    XDestroyImage(old_image);
+    num_hits_++;
+    return reused;
+  }
+
+  for (size_t i = 0; i < evicted.size(); ++i)
+    DestroyBuffer(evicted[i]);
+
+  num_misses_++;
+  Buffer* buffer = CreateBuffer(visual, depth, width, height);
+  if (buffer) {
+    lock_guard<mutex> lock(mutex_);
+    buffers_.push_back(buffer);
+  }
+  return buffer;
+}
+
+CapturePool::Buffer* CapturePool::CreateBuffer(Visual* visual, int depth,
+                                               unsigned int width,
+                                               unsigned int height) {
+  Buffer* buffer = new Buffer;
+  buffer->visual = visual;
+  memset(&buffer->shm_info, 0, sizeof(buffer->shm_info));
+  buffer->image = XShmCreateImage(display_, visual, depth, ZPixmap, NULL,
+                                  &buffer->shm_info, width, height);
+  if (!buffer->image) {
+    delete buffer;
+    return NULL;
+  }
+
+  size_t size = static_cast<size_t>(buffer->image->bytes_per_line) *
+                buffer->image->height;
+  buffer->shm_info.shmid = -1;
+  if (use_huge_pages_) {
+    const size_t huge_size =
+        (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+    buffer->shm_info.shmid =
+        shmget(IPC_PRIVATE, huge_size, IPC_CREAT | SHM_HUGETLB | 0600);
+    if (buffer->shm_info.shmid >= 0)
+      size = huge_size;
+    else
+      PLOG(WARNING) << "Unable to allocate huge pages for capture buffer";
+  }
+  if (buffer->shm_info.shmid < 0)
+    buffer->shm_info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (buffer->shm_info.shmid < 0) {
+    PLOG(WARNING) << "Unable to create " << size << "-byte shm segment";
+    XDestroyImage(buffer->image);
+    delete buffer;
+    return NULL;
+  }
+
+  buffer->shm_info.shmaddr =
+      static_cast<char*>(shmat(buffer->shm_info.shmid, NULL, 0));
+  if (buffer->shm_info.shmaddr == reinterpret_cast<char*>(-1)) {
+    PLOG(WARNING) << "Unable to attach " << size << "-byte shm segment";
+    shmctl(buffer->shm_info.shmid, IPC_RMID, NULL);
+    XDestroyImage(buffer->image);
+    delete buffer;
+    return NULL;
+  }
+  buffer->shm_info.readOnly = False;
+  buffer->image->data = buffer->shm_info.shmaddr;
+
+  XErrorHandler old_handler = XSetErrorHandler(HandleShmAttachError);
+  g_shm_attach_failed = false;
+  XShmAttach(display_, &buffer->shm_info);
+  XSync(display_, False);
+  XSetErrorHandler(old_handler);
+
+  // The segment will be destroyed once both we and the X server detach.
+  shmctl(buffer->shm_info.shmid, IPC_RMID, NULL);
+
+  if (g_shm_attach_failed) {
+    LOG(WARNING) << "Unable to attach shm segment to X server; "
+                 << "not pooling captures";
+    use_shm_ = false;
+    shmdt(buffer->shm_info.shmaddr);
+    buffer->image->data = NULL;
+    XDestroyImage(buffer->image);
+    delete buffer;
+    return NULL;
+  }
+
+  // Fault in all of the pages now rather than during the first capture.
+  memset(buffer->shm_info.shmaddr, 0, size);
+  buffer->size = size;
+  return buffer;
+}
+
+void CapturePool::DestroyBuffer(Buffer* buffer) {
+  XShmDetach(display_, &buffer->shm_info);
+  XSync(display_, False);
+  shmdt(buffer->shm_info.shmaddr);
+  buffer->image->data = NULL;
+  XDestroyImage(buffer->image);
+  delete buffer;
+}
+
+}  // namespace screenshot
@@ -0,0 +1,83 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_CAPTURE_POOL_H_
+#define SCREENSHOT_CAPTURE_POOL_H_
+
+#include <mutex>
+#include <vector>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+namespace screenshot {
+
+// Fetches window contents from the X server into reusable buffers.
+//
+// When the MIT-SHM extension is usable, images are read with XShmGetImage()
+// directly into shared memory segments that are kept around after being
+// released, so repeated captures don't need to allocate, fault in and free
+// tens of megabytes per frame.  A segment can be reused for any capture that
+// fits in it, and only a few unused segments are kept.  Otherwise,
+// XGetImage() is used and released images are simply destroyed.
+class CapturePool {
+ public:
+  // If |use_huge_pages| is true, segments are backed by huge pages when the
+  // kernel has them available.
+  CapturePool(Display* display, bool use_huge_pages);
+  ~CapturePool();
+
+  int num_hits() const { return num_hits_; }
+  int num_misses() const { return num_misses_; }
+
+  // Fetches the |width|x|height| region at (|x|, |y|) in |win|.  Returns
+  // NULL on failure.  The image must be passed to Release() rather than
+  // XDestroyImage() once it's no longer needed.
+  XImage* Capture(Window win,
+                  int x, int y, unsigned int width, unsigned int height);
+
+  // Returns |image| to the pool.  Unlike the other methods, this may be
+  // called from any thread.
+  void Release(XImage* image);
+
+ private:
+  struct Buffer;
+
+  // Returns an unused buffer holding an image with the given parameters,
+  // reusing the smallest unused segment that's big enough or else creating
+  // a new one.  Returns NULL if a buffer couldn't be created.
+  Buffer* GetBuffer(Visual* visual, int depth,
+                    unsigned int width, unsigned int height);
+
+  // Creates a new shared memory buffer, returning NULL on failure.
+  Buffer* CreateBuffer(Visual* visual, int depth,
+                       unsigned int width, unsigned int height);
+
+  void DestroyBuffer(Buffer* buffer);
+
+  Display* display_;  // not owned
+  bool use_shm_;
+  bool use_huge_pages_;
+
+  // Visual and depth of the most-recently-captured window.
+  Window last_win_;
+  Visual* last_visual_;
+  int last_depth_;
+
+  // Protects |buffers_|, |free_buffers_| and the buffers' images.
+  std::mutex mutex_;
+
+  // All buffers that have been created, and those not currently in use
+  // (least-recently released first).
+  std::vector<Buffer*> buffers_;
+  std::vector<Buffer*> free_buffers_;
+
+  // Number of captures that did and didn't reuse an existing buffer.
+  int num_hits_;
+  int num_misses_;
+};
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_CAPTURE_POOL_H_
@@ -0,0 +1,218 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "clipboard.h"
+
+#include <algorithm>
+
+#include <X11/Xatom.h>
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+using std::min;
+using std::string;
+
+namespace screenshot {
+
+namespace {
+
+// Largest property that we'll write in one request, in bytes.  Larger
+// images are sent incrementally.
+static const size_t kMaxChunkSize = 256 * 1024;
+
+// X error handler installed while serving the selection.  Requestors may
+// destroy their windows at any time, which shouldn't be fatal for us.
+int HandleClipboardError(Display* display, XErrorEvent* event) {
+  char message[256];
+  XGetErrorText(display, event->error_code, message, sizeof(message));
+  LOG(WARNING) << "Ignoring X error while serving clipboard: " << message;
+  return 0;
+}
+
+}  // namespace
+
+ClipboardServer::ClipboardServer(Display* display, const Image& image,
+                                 const PngOptions& options)
+    : display_(display),
+      image_(image),
+      options_(options),
+      win_(None),
+      acquire_time_(CurrentTime),
+      clipboard_atom_(XInternAtom(display_, "CLIPBOARD", False)),
+      targets_atom_(XInternAtom(display_, "TARGETS", False)),
+      timestamp_atom_(XInternAtom(display_, "TIMESTAMP", False)),
+      incr_atom_(XInternAtom(display_, "INCR", False)),
+      png_atom_(XInternAtom(display_, "image/png", False)),
+      have_png_(false) {
+  // XMaxRequestSize() is in four-byte units, and leave room for the
+  // ChangeProperty request's header.
+  max_chunk_size_ =
+      min(kMaxChunkSize, static_cast<size_t>(XMaxRequestSize(display_)) * 4 -
+                         64);
+
+  XSetWindowAttributes attr;
+  attr.override_redirect = True;
+  attr.event_mask = PropertyChangeMask;
+  win_ = XCreateWindow(display_,
+                       DefaultRootWindow(display_),
+                       -1, -1, 1, 1,    // geometry
+                       0,               // border_width
+                       CopyFromParent,  // depth
+                       InputOnly,       // class
+                       NULL,            // visual
+                       CWOverrideRedirect | CWEventMask,
+                       &attr);
+}
+
+ClipboardServer::~ClipboardServer() {
+  XDestroyWindow(display_, win_);
+}
+
+bool ClipboardServer::TakeOwnership() {
+  acquire_time_ = GetServerTime();
+  XSetSelectionOwner(display_, clipboard_atom_, win_, acquire_time_);
+  return XGetSelectionOwner(display_, clipboard_atom_) == win_;
+}
+
+void ClipboardServer::Run() {
+  XErrorHandler old_handler = XSetErrorHandler(HandleClipboardError);
+  bool owner = true;
+  while (owner || !transfers_.empty()) {
+    XEvent event;
+    XNextEvent(display_, &event);
+    switch (event.type) {
+      case SelectionClear:
+        if (event.xselectionclear.selection == clipboard_atom_)
+          owner = false;
+        break;
+      case SelectionRequest:
+        HandleSelectionRequest(event.xselectionrequest);
+        break;
+      case PropertyNotify:
+        HandlePropertyNotify(event.xproperty);
+        break;
+      case DestroyNotify:
+        // Abandon transfers to windows that have gone away.
+        for (size_t i = 0; i < transfers_.size(); ++i) {
+          if (transfers_[i].requestor == event.xdestroywindow.window) {
+            transfers_.erase(transfers_.begin() + i);
+            break;
+          }
+        }
+        break;
+    }
+  }
+  XSetErrorHandler(old_handler);
+}
+
+const string& ClipboardServer::GetPng() {
+  if (!have_png_) {
+    CHECK(EncodePng(image_, options_, &png_))
+        << "Unable to encode image as PNG";
+    have_png_ = true;
+  }
+  return png_;
+}
+
+Time ClipboardServer::GetServerTime() {
+  // Make a no-op change to a property and use the timestamp from the
+  // resulting PropertyNotify event.
+  XChangeProperty(display_, win_, XA_WM_NAME, XA_STRING, 8, PropModeAppend,
+                  NULL, 0);
+  XEvent event;
+  XWindowEvent(display_, win_, PropertyChangeMask, &event);
+  return event.xproperty.time;
+}
+
+void ClipboardServer::HandleSelectionRequest(
+    const XSelectionRequestEvent& request) {
+  XSelectionEvent reply;
+  reply.type = SelectionNotify;
+  reply.display = request.display;
+  reply.requestor = request.requestor;
+  reply.selection = request.selection;
+  reply.target = request.target;
+  reply.time = request.time;
+  // Obsolete clients may not supply a property.
+  reply.property = request.property != None ?
+      request.property : request.target;
+
+  if (request.selection != clipboard_atom_ ||
+      (request.time != CurrentTime && request.time < acquire_time_)) {
+    reply.property = None;
+  } else if (request.target == targets_atom_) {
+    const Atom targets[] = { targets_atom_, timestamp_atom_, png_atom_ };
+    XChangeProperty(display_, request.requestor, reply.property, XA_ATOM,
+                    32, PropModeReplace,
+                    reinterpret_cast<const unsigned char*>(targets),
+                    sizeof(targets) / sizeof(targets[0]));
+  } else if (request.target == timestamp_atom_) {
+    const long timestamp = acquire_time_;
+    XChangeProperty(display_, request.requestor, reply.property, XA_INTEGER,
+                    32, PropModeReplace,
+                    reinterpret_cast<const unsigned char*>(&timestamp), 1);
+  } else if (request.target == png_atom_) {
+    const string& png = GetPng();
+    if (png.size() <= max_chunk_size_) {
+      XChangeProperty(display_, request.requestor, reply.property, png_atom_,
+                      8, PropModeReplace,
+                      reinterpret_cast<const unsigned char*>(png.data()),
+                      png.size());
+    } else {
+      // Start an INCR transfer: announce the size, and then send chunks
+      // each time that the requestor deletes the property.
+      Transfer transfer;
+      transfer.requestor = request.requestor;
+      transfer.property = reply.property;
+      transfer.offset = 0;
+      transfers_.push_back(transfer);
+      XSelectInput(display_, request.requestor,
+                   PropertyChangeMask | StructureNotifyMask);
+      const long size = png.size();
+      XChangeProperty(display_, request.requestor, reply.property,
+                      incr_atom_, 32, PropModeReplace,
+                      reinterpret_cast<const unsigned char*>(&size), 1);
+    }
+  } else {
+    reply.property = None;
+  }
+
+  XSendEvent(display_, request.requestor, False, NoEventMask,
+             reinterpret_cast<XEvent*>(&reply));
+  XFlush(display_);
+}
+
+void ClipboardServer::HandlePropertyNotify(const XPropertyEvent& event) {
+  if (event.state != PropertyDelete)
+    return;
+
+  for (size_t i = 0; i < transfers_.size(); ++i) {
+    Transfer* transfer = &transfers_[i];
+    if (transfer->requestor != event.window ||
+        transfer->property != event.atom)
+      continue;
+
+    // A zero-length chunk marks the end of the transfer.
+    const string& png = GetPng();
+    const size_t size = min(max_chunk_size_, png.size() - transfer->offset);
+    XChangeProperty(display_, transfer->requestor, transfer->property,
+                    png_atom_, 8, PropModeReplace,
+                    reinterpret_cast<const unsigned char*>(png.data()) +
+                        transfer->offset,
+                    size);
+    transfer->offset += size;
+    if (size == 0) {
+      XSelectInput(display_, transfer->requestor, NoEventMask);
+      transfers_.erase(transfers_.begin() + i);
+    }
+    XFlush(display_);
+    return;
+  }
+}
+
+}  // namespace screenshot
@@ -0,0 +1,84 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_CLIPBOARD_H_
+#define SCREENSHOT_CLIPBOARD_H_
+
+#include <string>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+#include "image.h"
+#include "png_encoder.h"
+
+namespace screenshot {
+
+// Serves an image as the contents of the CLIPBOARD selection, using the
+// image/png target.  The PNG is only encoded once a client asks for it, and
+// is kept for later requests.  Data too large for a single X request is
+// sent using the ICCCM's INCR protocol.
+class ClipboardServer {
+ public:
+  // |image| must remain valid for as long as the server is running.
+  ClipboardServer(Display* display, const Image& image,
+                  const PngOptions& options);
+  ~ClipboardServer();
+
+  // Takes ownership of the CLIPBOARD selection, returning false on failure.
+  bool TakeOwnership();
+
+  // Handles requests until another client takes ownership of the selection
+  // and all in-progress transfers have finished.
+  void Run();
+
+ private:
+  // An in-progress INCR transfer.
+  struct Transfer {
+    Window requestor;
+    Atom property;
+    size_t offset;  // amount of |png_| sent so far
+  };
+
+  // Returns the encoded image, encoding it first if needed.
+  const std::string& GetPng();
+
+  // Returns the current server time, which ICCCM asks us to use (rather than
+  // CurrentTime) when acquiring a selection.
+  Time GetServerTime();
+
+  void HandleSelectionRequest(const XSelectionRequestEvent& request);
+
+  // Sends the next chunk of an INCR transfer once the requestor has deleted
+  // the previous one.
+  void HandlePropertyNotify(const XPropertyEvent& event);
+
+  Display* display_;  // not owned
+  Image image_;
+  PngOptions options_;
+
+  // Window that owns the selection.
+  Window win_;
+
+  // Time at which we acquired the selection.
+  Time acquire_time_;
+
+  Atom clipboard_atom_;
+  Atom targets_atom_;
+  Atom timestamp_atom_;
+  Atom incr_atom_;
+  Atom png_atom_;
+
+  // Maximum number of bytes that we'll send in a single property.
+  size_t max_chunk_size_;
+
+  bool have_png_;
+  std::string png_;
+
+  std::vector<Transfer> transfers_;
+};
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_CLIPBOARD_H_
@@ -0,0 +1,199 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "convert.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "cpu_dispatch.h"
+
+using std::min;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// Added before truncating in UnpremultiplyChannel().  Without it, float
+// rounding makes some exact quotients come out just below an integer; it's
+// small enough not to push any inexact ones over (checked exhaustively).
+static const float kUnpremultiplyRoundingBias = 1.0f / 1024;
+
+// Returns |value| divided by |alpha| in the same manner as Cairo's PNG
+// writer: (value * 255 + alpha / 2) / alpha.  |scale| must be 1 / |alpha|,
+// or anything if |alpha| is 0.  Values above |alpha| (which aren't valid
+// premultiplied colors) saturate at 255.  Floating-point multiplication is
+// used instead of integer division so that the loops calling this can be
+// vectorized.
+KERNEL_IMPL unsigned char UnpremultiplyChannel(int value, int alpha,
+                                               float scale) {
+  return static_cast<int>((min(value, alpha) * 255 + (alpha >> 1)) * scale +
+                          kUnpremultiplyRoundingBias);
+}
+
+// Returns 1 / |alpha|, or 1 if |alpha| is 0.  This is branch-free (unlike
+// std::max()), which lets it be vectorized.
+KERNEL_IMPL float GetUnpremultiplyScale(int alpha) {
+  return 1.0f / static_cast<float>(alpha + (alpha == 0));
+}
+
+// Returns |pixel| with its color channels divided by its alpha channel.
+inline uint32_t Unpremultiply(uint32_t pixel) {
+  const int alpha = pixel >> 24;
+  const float scale = GetUnpremultiplyScale(alpha);
+  const uint32_t red =
+      UnpremultiplyChannel((pixel >> 16) & 0xff, alpha, scale);
+  const uint32_t green =
+      UnpremultiplyChannel((pixel >> 8) & 0xff, alpha, scale);
+  const uint32_t blue = UnpremultiplyChannel(pixel & 0xff, alpha, scale);
+  return (alpha << 24) | (red << 16) | (green << 8) | blue;
+}
+
+// Converts a row of |width| pixels without alpha to packed RGB.
+KERNEL_IMPL void ConvertOpaqueRowImpl(const uint32_t* __restrict src,
+                                      unsigned char* __restrict dst,
+                                      int width) {
+  for (int x = 0; x < width; ++x) {
+    const uint32_t pixel = src[x];
+    dst[x * 3] = (pixel >> 16) & 0xff;
+    dst[x * 3 + 1] = (pixel >> 8) & 0xff;
+    dst[x * 3 + 2] = pixel & 0xff;
+  }
+}
+
+// Converts a row of |width| premultiplied pixels to packed straight-alpha
+// RGBA, unpremultiplying in the same pass.
+KERNEL_IMPL void ConvertPremultipliedRowImpl(const uint32_t* __restrict src,
+                                             unsigned char* __restrict dst,
+                                             int width) {
+  for (int x = 0; x < width; ++x) {
+    const uint32_t pixel = src[x];
+    const int alpha = pixel >> 24;
+    const float scale = GetUnpremultiplyScale(alpha);
+    dst[x * 4] = UnpremultiplyChannel((pixel >> 16) & 0xff, alpha, scale);
+    dst[x * 4 + 1] = UnpremultiplyChannel((pixel >> 8) & 0xff, alpha, scale);
+    dst[x * 4 + 2] = UnpremultiplyChannel(pixel & 0xff, alpha, scale);
+    dst[x * 4 + 3] = alpha;
+  }
+}
+
+// Returns the bitwise OR of the differences between each of the |width|
+// pixels in |row| and |color|, which is zero if they're all the same.  This
+// checks the whole row rather than stopping at the first difference so that
+// it vectorizes.
+KERNEL_IMPL uint32_t GetRowDifferenceImpl(const uint32_t* __restrict row,
+                                          int width, uint32_t color) {
+  uint32_t difference = 0;
+  for (int x = 0; x < width; ++x)
+    difference |= row[x] ^ color;
+  return difference;
+}
+
+// ORs the difference between each of the |width| pixels in |row| and |color|
+// into |differences|, to find the columns that differ in any row.
+KERNEL_IMPL void AccumulateColumnDifferencesImpl(
+    const uint32_t* __restrict row, int width, uint32_t color,
+    uint32_t* __restrict differences) {
+  for (int x = 0; x < width; ++x)
+    differences[x] |= row[x] ^ color;
+}
+
+DEFINE_CPU_VARIANTS(void, ConvertOpaqueRow,
+                    (const uint32_t* src, unsigned char* dst, int width),
+                    (src, dst, width))
+DEFINE_CPU_VARIANTS(void, ConvertPremultipliedRow,
+                    (const uint32_t* src, unsigned char* dst, int width),
+                    (src, dst, width))
+DEFINE_CPU_VARIANTS(uint32_t, GetRowDifference,
+                    (const uint32_t* row, int width, uint32_t color),
+                    (row, width, color))
+DEFINE_CPU_VARIANTS(void, AccumulateColumnDifferences,
+                    (const uint32_t* row, int width, uint32_t color,
+                     uint32_t* differences),
+                    (row, width, color, differences))
+
+}  // namespace
+
+void ConvertImage(const Image& image, bool count_colors, RgbImage* out) {
+  out->width = image.width;
+  out->height = image.height;
+  out->channels = image.has_alpha ? 4 : 3;
+  out->data.resize(out->row_size() * image.height);
+  out->colors.clear();
+
+  ColorTable table;
+  const int bpp = out->channels;
+  void (*convert_row)(const uint32_t*, unsigned char*, int) =
+      image.has_alpha ? SELECT_CPU_VARIANT(ConvertPremultipliedRow) :
+                        SELECT_CPU_VARIANT(ConvertOpaqueRow);
+  for (int y = 0; y < image.height; ++y) {
+    const uint32_t* src = image.Row(y);
+    unsigned char* dst = &out->data[y * out->row_size()];
+    // Once we've stopped counting colors, the kernels can do the rest.
+    if (!count_colors) {
+      convert_row(src, dst, image.width);
+      continue;
+    }
+    for (int x = 0; x < image.width; ++x, dst += bpp) {
+      const uint32_t pixel = image.has_alpha ?
+          Unpremultiply(src[x]) : (src[x] | 0xff000000);
+      if (count_colors && table.Insert(pixel) < 0)
+        count_colors = false;
+      dst[0] = (pixel >> 16) & 0xff;
+      dst[1] = (pixel >> 8) & 0xff;
+      dst[2] = pixel & 0xff;
+      if (image.has_alpha)
+        dst[3] = pixel >> 24;
+    }
+  }
+
+  out->palette_valid = count_colors;
+  if (count_colors) {
+    for (int i = 0; i < table.num_colors(); ++i)
+      out->colors.push_back(table.color(i));
+  }
+}
+
+Image TrimImage(const Image& image) {
+  if (image.width <= 0 || image.height <= 0)
+    return image;
+
+  // Without alpha, the top byte of each pixel is undefined.
+  const uint32_t mask = image.has_alpha ? 0xffffffff : 0x00ffffff;
+  const uint32_t color = image.Row(0)[0];
+  uint32_t (*get_row_difference)(const uint32_t*, int, uint32_t) =
+      SELECT_CPU_VARIANT(GetRowDifference);
+
+  // Uniform rows are found a row at a time from the top and bottom...
+  int top = 0;
+  while (top < image.height &&
+         !(get_row_difference(image.Row(top), image.width, color) & mask))
+    top++;
+  if (top == image.height)
+    return image.GetRegion(0, 0, 1, 1);
+  int bottom = image.height - 1;
+  while (!(get_row_difference(image.Row(bottom), image.width, color) & mask))
+    bottom--;
+
+  // ...and uniform columns by combining the remaining rows' differences.
+  void (*accumulate_column_differences)(const uint32_t*, int, uint32_t,
+                                        uint32_t*) =
+      SELECT_CPU_VARIANT(AccumulateColumnDifferences);
+  vector<uint32_t> differences(image.width, 0);
+  for (int y = top; y <= bottom; ++y) {
+    accumulate_column_differences(image.Row(y), image.width, color,
+                                  &differences[0]);
+  }
+  int left = 0;
+  while (!(differences[left] & mask))
+    left++;
+  int right = image.width - 1;
+  while (!(differences[right] & mask))
+    right--;
+
+  return image.GetRegion(left, top, right - left + 1, bottom - top + 1);
+}
+
+}  // namespace screenshot
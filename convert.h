@@ -0,0 +1,122 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_CONVERT_H_
+#define SCREENSHOT_CONVERT_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "image.h"
+
+namespace screenshot {
+
+// Maximum number of entries in a PNG palette.
+static const int kMaxPaletteSize = 256;
+
+// Open-addressed hash set used to count the distinct colors in an image and
+// to assign each one a palette index.  Counting stops as soon as more colors
+// are seen than fit in a palette.
+class ColorTable {
+ public:
+  ColorTable()
+      : num_colors_(0),
+        overflowed_(false),
+        last_color_(0),
+        last_index_(-1) {
+    std::fill(slots_, slots_ + kNumSlots, -1);
+  }
+
+  bool overflowed() const { return overflowed_; }
+  int num_colors() const { return num_colors_; }
+  uint32_t color(int index) const { return colors_[index]; }
+
+  // Returns the palette index of |color|, adding it to the table if needed.
+  // Returns -1 if the table has overflowed.
+  int Insert(uint32_t color) {
+    // Screenshots are dominated by runs of identical pixels, so check the
+    // most-recently-seen color before hashing.
+    if (color == last_color_ && last_index_ >= 0)
+      return last_index_;
+    if (overflowed_)
+      return -1;
+
+    uint32_t slot = (color * 2654435761U) >> (32 - kSlotBits);
+    int index = -1;
+    while (true) {
+      index = slots_[slot];
+      if (index < 0) {
+        if (num_colors_ == kMaxPaletteSize) {
+          overflowed_ = true;
+          return -1;
+        }
+        index = num_colors_++;
+        colors_[index] = color;
+        slots_[slot] = index;
+        break;
+      }
+      if (colors_[index] == color)
+        break;
+      slot = (slot + 1) & (kNumSlots - 1);
+    }
+    last_color_ = color;
+    last_index_ = index;
+    return index;
+  }
+
+ private:
+  // The table is kept at most a quarter full so that probes stay short.
+  static const int kSlotBits = 10;
+  static const int kNumSlots = 1 << kSlotBits;
+
+  int slots_[kNumSlots];  // indexes into |colors_|, or -1 if empty
+  uint32_t colors_[kMaxPaletteSize];
+  int num_colors_;
+  bool overflowed_;
+
+  uint32_t last_color_;
+  int last_index_;
+};
+
+// Image data converted to packed 8-bit RGB or RGBA rows (with straight
+// rather than premultiplied alpha), as consumed by the encoders.  This is
+// immutable once created, so several encoders may read it concurrently.
+struct RgbImage {
+  RgbImage()
+      : width(0),
+        height(0),
+        channels(0),
+        palette_valid(false) {
+  }
+
+  size_t row_size() const { return static_cast<size_t>(width) * channels; }
+  const unsigned char* Row(int y) const { return &data[y * row_size()]; }
+
+  int width;
+  int height;
+  int channels;  // 3 for RGB, 4 for RGBA
+  std::vector<unsigned char> data;
+
+  // If |palette_valid| is true, |colors| lists every distinct color in the
+  // image as a 0xAARRGGBB value.
+  bool palette_valid;
+  std::vector<uint32_t> colors;
+};
+
+// Converts |image| to |out|.  If |count_colors| is true, the image's colors
+// are counted during the conversion and saved if there are at most
+// kMaxPaletteSize of them.
+void ConvertImage(const Image& image, bool count_colors, RgbImage* out);
+
+// Returns the smallest region of |image| outside of which every pixel is the
+// same color as the top-left one (ignoring alpha if |image| has none), i.e.
+// |image| with any uniform margins cropped away.  An image that's entirely
+// that color is trimmed to its top-left pixel.
+Image TrimImage(const Image& image);
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_CONVERT_H_
@@ -0,0 +1,74 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "cpu_dispatch.h"
+
+#include <atomic>
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+using std::string;
+
+namespace screenshot {
+
+namespace {
+
+// Level that kernels use, or -1 if it hasn't been determined yet.
+std::atomic<int> g_cpu_level(-1);
+
+}  // namespace
+
+CpuLevel GetSupportedCpuLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    return CPU_LEVEL_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return CPU_LEVEL_AVX2;
+#endif
+  return CPU_LEVEL_BASELINE;
+}
+
+CpuLevel GetCpuLevel() {
+  int level = g_cpu_level.load(std::memory_order_relaxed);
+  if (level < 0) {
+    // Racing threads will all store the same value.
+    level = GetSupportedCpuLevel();
+    g_cpu_level.store(level, std::memory_order_relaxed);
+  }
+  return static_cast<CpuLevel>(level);
+}
+
+void SetCpuLevel(CpuLevel level) {
+  CHECK(level <= GetSupportedCpuLevel())
+      << "This CPU doesn't support " << GetCpuLevelName(level);
+  g_cpu_level.store(level, std::memory_order_relaxed);
+}
+
+bool ParseCpuLevel(const string& name, CpuLevel* level) {
+  if (name == "baseline")
+    *level = CPU_LEVEL_BASELINE;
+  else if (name == "avx2")
+    *level = CPU_LEVEL_AVX2;
+  else if (name == "avx512")
+    *level = CPU_LEVEL_AVX512;
+  else
+    return false;
+  return true;
+}
+
+const char* GetCpuLevelName(CpuLevel level) {
+  switch (level) {
+    case CPU_LEVEL_BASELINE: return "baseline";
+    case CPU_LEVEL_AVX2:     return "avx2";
+    case CPU_LEVEL_AVX512:   return "avx512";
+  }
+  return "unknown";
+}
+
+}  // namespace screenshot
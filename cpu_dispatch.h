@@ -0,0 +1,72 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_CPU_DISPATCH_H_
+#define SCREENSHOT_CPU_DISPATCH_H_
+
+#include <string>
+
+// Hot pixel loops ("kernels") are written once as always-inline functions
+// named FooImpl() and compiled into a copy for each supported instruction
+// set with DEFINE_CPU_VARIANTS().  SELECT_CPU_VARIANT() then picks the copy
+// for the current CPU level, which is detected at startup and may be
+// lowered with SetCpuLevel() for benchmarking.  The loops are written so
+// that the compiler vectorizes them; the wider variants just let it use
+// wider vectors.
+
+#define KERNEL_IMPL inline __attribute__((always_inline))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+// Defines NameBaseline(), NameAvx2(), and NameAvx512(), each of which calls
+// NameImpl().  |params| is the parenthesized parameter list and |args| is
+// the parenthesized list of arguments to forward.
+#define DEFINE_CPU_VARIANTS(return_type, name, params, args)           \
+  return_type name##Baseline params { return name##Impl args; }        \
+  TARGET_AVX2 return_type name##Avx2 params { return name##Impl args; } \
+  TARGET_AVX512 return_type name##Avx512 params { return name##Impl args; }
+
+// Evaluates to the variant of |name| for the current CPU level.
+#define SELECT_CPU_VARIANT(name)                                       \
+  (::screenshot::GetCpuLevel() >= ::screenshot::CPU_LEVEL_AVX512 ?     \
+       name##Avx512 :                                                  \
+   ::screenshot::GetCpuLevel() >= ::screenshot::CPU_LEVEL_AVX2 ?       \
+       name##Avx2 : name##Baseline)
+
+namespace screenshot {
+
+// Instruction sets that kernels are compiled for, in increasing order.
+enum CpuLevel {
+  CPU_LEVEL_BASELINE,  // whatever the compiler targets by default (e.g. SSE2)
+  CPU_LEVEL_AVX2,
+  CPU_LEVEL_AVX512,    // AVX-512F and AVX-512BW
+};
+
+// Returns the highest level that this CPU supports.
+CpuLevel GetSupportedCpuLevel();
+
+// Returns the level that kernels currently use.  Defaults to
+// GetSupportedCpuLevel().
+CpuLevel GetCpuLevel();
+
+// Makes kernels use |level|, which must be supported by this CPU.  Should
+// be called at startup, before any kernels run.
+void SetCpuLevel(CpuLevel level);
+
+// Parses "baseline", "avx2", or "avx512" into |level|, returning false if
+// |name| isn't one of them.
+bool ParseCpuLevel(const std::string& name, CpuLevel* level);
+
+// Returns the name of |level|, as accepted by ParseCpuLevel().
+const char* GetCpuLevelName(CpuLevel level);
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_CPU_DISPATCH_H_
@@ -0,0 +1,540 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "fast_deflate.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+#include "cpu_dispatch.h"
+
+using std::max;
+using std::min;
+using std::pair;
+using std::sort;
+using std::string;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// Amount of input compressed as each deflate block.  Smaller blocks adapt
+// their codes to the data more closely but spend more on headers.
+static const size_t kBlockSize = 256 * 1024;
+
+// Shortest and longest runs written as matches.  Shorter runs are written
+// as literals, which are often just a bit or two each.  FindRunStart()
+// assumes that the minimum is 4.
+static const size_t kMinRunLength = 4;
+static const size_t kMaxRunLength = 258;
+
+// WriteBlock() tokens are literal bytes, or kRunToken plus a run length.
+static const int kRunToken = 256;
+static const int kNumTokens = kRunToken + kMaxRunLength + 1;
+
+// Each token's complete bit string is packed into a uint32_t, with the
+// number of bits in the top byte.
+static const int kTokenLengthShift = 24;
+
+// Deflate's distance alphabet.  Only symbols for distances 1-4, which have
+// no extra bits, are used.
+static const int kMaxRunDistance = 4;
+
+// Deflate's literal/length alphabet: literals, then the end-of-block symbol,
+// then the length symbols.
+static const int kEndOfBlock = 256;
+static const int kFirstLengthSymbol = 257;
+static const int kNumLiteralLengthSymbols = 286;
+static const int kNumLengthSymbols = 29;
+static const int kLengthBase[kNumLengthSymbols] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const int kLengthExtraBits[kNumLengthSymbols] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+// The code-length alphabet used to describe a block's codes, and the order
+// in which its own code lengths are written.
+static const int kNumCodeLengthSymbols = 19;
+static const int kRepeatPreviousSymbol = 16;  // 3-6 copies, 2 extra bits
+static const int kRepeatZeroSymbol = 17;      // 3-10 zeros, 3 extra bits
+static const int kLongRepeatZeroSymbol = 18;  // 11-138 zeros, 7 extra bits
+static const unsigned char kCodeLengthOrder[kNumCodeLengthSymbols] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static const int kMaxCodeLength = 15;
+static const int kMaxCodeLengthCodeLength = 7;
+
+// Largest block header: the fixed fields, the code-length code, and at most
+// seven bits for each of the 286 + 1 code lengths that it describes.
+static const size_t kMaxHeaderBytes = 400;
+
+// Adler-32's modulus, and the number of bytes that Adler32Impl() can sum
+// before reducing without overflowing 32 bits: the weighted sum is at most
+// 255 * n * (n + 1) / 2.
+static const uint32_t kAdlerModulus = 65521;
+static const size_t kAdlerBlockSize = 4096;
+
+// Returns the Adler-32 checksum |adler| updated with |size| bytes of |data|.
+// zlib's adler32() updates its sums serially; here each block's plain and
+// position-weighted sums are independent reductions, so they vectorize.
+KERNEL_IMPL uint32_t Adler32Impl(uint32_t adler,
+                                 const unsigned char* __restrict data,
+                                 size_t size) {
+  uint32_t a = adler & 0xffff;
+  uint32_t b = adler >> 16;
+  while (size > 0) {
+    const uint32_t n = min(size, kAdlerBlockSize);
+    uint32_t sum = 0, weighted_sum = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+      sum += data[i];
+      weighted_sum += (n - i) * data[i];
+    }
+    b = (b + a * n + weighted_sum) % kAdlerModulus;
+    a = (a + sum) % kAdlerModulus;
+    data += n;
+    size -= n;
+  }
+  return b << 16 | a;
+}
+
+DEFINE_CPU_VARIANTS(uint32_t, Adler32,
+                    (uint32_t adler, const unsigned char* data, size_t size),
+                    (adler, data, size))
+
+// Writes bits to a buffer, least-significant bit first.
+class BitWriter {
+ public:
+  BitWriter(unsigned char* out, uint64_t bits, int num_bits)
+      : out_(out),
+        bits_(bits),
+        num_bits_(num_bits) {
+  }
+
+  unsigned char* out() const { return out_; }
+  uint64_t bits() const { return bits_; }
+  int num_bits() const { return num_bits_; }
+
+  // Writes the low |count| bits of |value|, where |count| is at most 32.
+  void Put(uint32_t value, int count) {
+    bits_ |= static_cast<uint64_t>(value) << num_bits_;
+    num_bits_ += count;
+    if (num_bits_ >= 32) {
+      out_[0] = bits_;
+      out_[1] = bits_ >> 8;
+      out_[2] = bits_ >> 16;
+      out_[3] = bits_ >> 24;
+      out_ += 4;
+      bits_ >>= 32;
+      num_bits_ -= 32;
+    }
+  }
+
+  // Writes out all complete bytes, or all bits (padding the last byte with
+  // zeros) if |pad| is true.
+  void Flush(bool pad) {
+    if (pad)
+      num_bits_ = (num_bits_ + 7) & ~7;
+    while (num_bits_ >= 8) {
+      *out_++ = bits_;
+      bits_ >>= 8;
+      num_bits_ -= 8;
+    }
+  }
+
+ private:
+  unsigned char* out_;
+  uint64_t bits_;
+  int num_bits_;
+};
+
+// Returns the number of leading bytes (at most |size|) that |data| and
+// |earlier| have in common.  The two may overlap.
+size_t CountMatch(const unsigned char* data, const unsigned char* earlier,
+                  size_t size) {
+  size_t length = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; length + 8 <= size; length += 8) {
+    uint64_t word, earlier_word;
+    memcpy(&word, data + length, sizeof(word));
+    memcpy(&earlier_word, earlier + length, sizeof(earlier_word));
+    const uint64_t diff = word ^ earlier_word;
+    if (diff)
+      return length + (__builtin_ctzll(diff) >> 3);
+  }
+#endif
+  while (length < size && data[length] == earlier[length])
+    length++;
+  return length;
+}
+
+// Number of positions that FindRunStart() checks at once.
+static const size_t kRunStartWindow = 5;
+
+// Returns the first of the kRunStartWindow offsets at which |data| and
+// |earlier| share at least kMinRunLength (i.e. 4) bytes, or kRunStartWindow
+// if there's none.  Both must have 8 readable bytes.
+size_t FindRunStart(const unsigned char* data, const unsigned char* earlier) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t word, earlier_word;
+  memcpy(&word, data, sizeof(word));
+  memcpy(&earlier_word, earlier, sizeof(earlier_word));
+  const uint64_t diff = word ^ earlier_word;
+  // Set the top bit of each byte that's the same in both.
+  const uint64_t kLowBits = 0x7f7f7f7f7f7f7f7fULL;
+  const uint64_t same = ~(((diff & kLowBits) + kLowBits) | diff | kLowBits);
+  // Then of each byte that starts four such bytes.  Only the first five
+  // bytes can, since zeros are shifted in.
+  const uint64_t starts = same & (same >> 8) & (same >> 16) & (same >> 24);
+  return starts ? __builtin_ctzll(starts) >> 3 : kRunStartWindow;
+#else
+  for (size_t offset = 0; offset < kRunStartWindow; ++offset) {
+    if (memcmp(data + offset, earlier + offset, kMinRunLength) == 0)
+      return offset;
+  }
+  return kRunStartWindow;
+#endif
+}
+
+// Replaces |weights|, which must be sorted in increasing order, with the
+// lengths of an optimal prefix code for them, using Moffat and Katajainen's
+// in-place algorithm.  |num_weights| must be at least 2.
+void ComputeCodeLengths(int* weights, int num_weights) {
+  int* a = weights;
+  const int n = num_weights;
+  // Build the tree, storing internal node weights and then parent indexes.
+  a[0] += a[1];
+  int root = 0, leaf = 2;
+  for (int next = 1; next < n - 1; ++next) {
+    if (leaf >= n || a[root] < a[leaf]) {
+      a[next] = a[root];
+      a[root++] = next;
+    } else {
+      a[next] = a[leaf++];
+    }
+    if (leaf >= n || (root < next && a[root] < a[leaf])) {
+      a[next] += a[root];
+      a[root++] = next;
+    } else {
+      a[next] += a[leaf++];
+    }
+  }
+  // Convert parent indexes to internal node depths.
+  a[n - 2] = 0;
+  for (int next = n - 3; next >= 0; --next)
+    a[next] = a[a[next]] + 1;
+  // Convert internal node depths to leaf depths.
+  int available = 1, used = 0, depth = 0;
+  root = n - 2;
+  int next = n - 1;
+  while (available > 0) {
+    while (root >= 0 && a[root] == depth) {
+      used++;
+      root--;
+    }
+    while (available > used) {
+      a[next--] = depth;
+      available--;
+    }
+    available = 2 * used;
+    depth++;
+    used = 0;
+  }
+}
+
+// Sets |lengths| to the lengths of a prefix code for |num_symbols| symbols
+// with frequencies |freqs|, with no code longer than |max_length|.  Unused
+// symbols get length 0.
+void BuildCodeLengths(const uint32_t* freqs, int num_symbols, int max_length,
+                      unsigned char* lengths) {
+  vector<pair<uint32_t, int> > used;
+  for (int i = 0; i < num_symbols; ++i) {
+    if (freqs[i])
+      used.push_back(std::make_pair(freqs[i], i));
+  }
+  memset(lengths, 0, num_symbols);
+  if (used.empty())
+    return;
+  if (used.size() == 1) {
+    lengths[used[0].second] = 1;
+    return;
+  }
+
+  // Codes only get too long with very skewed frequencies, so flatten them
+  // until they fit.  Shifting keeps the weights sorted.
+  sort(used.begin(), used.end());
+  vector<int> weights(used.size());
+  for (int shift = 0; ; ++shift) {
+    for (size_t i = 0; i < used.size(); ++i)
+      weights[i] = max<uint32_t>(used[i].first >> shift, 1);
+    ComputeCodeLengths(&weights[0], weights.size());
+    if (weights[0] <= max_length)  // the least frequent symbol's length
+      break;
+  }
+  for (size_t i = 0; i < used.size(); ++i)
+    lengths[used[i].second] = weights[i];
+}
+
+// Sets |codes| to the canonical Huffman codes for |lengths|, bit-reversed so
+// that they can be written least-significant bit first.
+void GetCanonicalCodes(const unsigned char* lengths, int num_symbols,
+                       uint16_t* codes) {
+  int count[kMaxCodeLength + 1] = { 0 };
+  for (int i = 0; i < num_symbols; ++i)
+    count[lengths[i]]++;
+  count[0] = 0;
+  int next_code[kMaxCodeLength + 1] = { 0 };
+  int code = 0;
+  for (int bits = 1; bits <= kMaxCodeLength; ++bits) {
+    code = (code + count[bits - 1]) << 1;
+    next_code[bits] = code;
+  }
+  for (int i = 0; i < num_symbols; ++i) {
+    const int length = lengths[i];
+    codes[i] = 0;
+    if (!length)
+      continue;
+    const int canonical = next_code[length]++;
+    for (int bit = 0; bit < length; ++bit)
+      codes[i] |= ((canonical >> bit) & 1) << (length - 1 - bit);
+  }
+}
+
+// Returns the deflate length symbol (minus kFirstLengthSymbol) for a match
+// of |length| bytes.
+int GetLengthSymbol(int length) {
+  int symbol = kNumLengthSymbols - 1;
+  while (kLengthBase[symbol] > length)
+    symbol--;
+  return symbol;
+}
+
+// Writes the header of a dynamic-Huffman block whose literal/length and
+// distance codes have the given lengths.
+void WriteBlockHeader(bool final,
+                      const unsigned char* literal_lengths,
+                      int num_literal_lengths,
+                      const unsigned char* distance_lengths,
+                      int num_distance_lengths,
+                      BitWriter* writer) {
+  // The code lengths are written back to back, run-length encoded with the
+  // repeat symbols.  Each entry of |symbols| is a symbol and its extra bits.
+  vector<unsigned char> all_lengths(literal_lengths,
+                                    literal_lengths + num_literal_lengths);
+  all_lengths.insert(all_lengths.end(), distance_lengths,
+                     distance_lengths + num_distance_lengths);
+  vector<pair<int, int> > symbols;
+  const int num_lengths = all_lengths.size();
+  for (int i = 0; i < num_lengths; ) {
+    const int length = all_lengths[i];
+    int run = 1;
+    while (i + run < num_lengths && all_lengths[i + run] == length)
+      run++;
+    if (length == 0 && run >= 3) {
+      run = min(run, 138);
+      if (run >= 11)
+        symbols.push_back(std::make_pair(kLongRepeatZeroSymbol, run - 11));
+      else
+        symbols.push_back(std::make_pair(kRepeatZeroSymbol, run - 3));
+      i += run;
+      continue;
+    }
+    symbols.push_back(std::make_pair(length, 0));
+    i++;
+    run--;
+    if (length == 0)
+      continue;
+    while (run >= 3) {
+      const int repeat = min(run, 6);
+      symbols.push_back(std::make_pair(kRepeatPreviousSymbol, repeat - 3));
+      i += repeat;
+      run -= repeat;
+    }
+  }
+
+  uint32_t freqs[kNumCodeLengthSymbols] = { 0 };
+  for (size_t i = 0; i < symbols.size(); ++i)
+    freqs[symbols[i].first]++;
+  unsigned char lengths[kNumCodeLengthSymbols];
+  uint16_t codes[kNumCodeLengthSymbols];
+  BuildCodeLengths(freqs, kNumCodeLengthSymbols, kMaxCodeLengthCodeLength,
+                   lengths);
+  GetCanonicalCodes(lengths, kNumCodeLengthSymbols, codes);
+  int num_code_length_codes = kNumCodeLengthSymbols;
+  while (num_code_length_codes > 4 &&
+         lengths[kCodeLengthOrder[num_code_length_codes - 1]] == 0)
+    num_code_length_codes--;
+
+  writer->Put(final, 1);
+  writer->Put(2, 2);  // BTYPE: dynamic Huffman codes
+  writer->Put(num_literal_lengths - 257, 5);
+  writer->Put(num_distance_lengths - 1, 5);
+  writer->Put(num_code_length_codes - 4, 4);
+  for (int i = 0; i < num_code_length_codes; ++i)
+    writer->Put(lengths[kCodeLengthOrder[i]], 3);
+  for (size_t i = 0; i < symbols.size(); ++i) {
+    const int symbol = symbols[i].first;
+    writer->Put(codes[symbol], lengths[symbol]);
+    if (symbol == kRepeatPreviousSymbol)
+      writer->Put(symbols[i].second, 2);
+    else if (symbol == kRepeatZeroSymbol)
+      writer->Put(symbols[i].second, 3);
+    else if (symbol == kLongRepeatZeroSymbol)
+      writer->Put(symbols[i].second, 7);
+  }
+}
+
+}  // namespace
+
+FastDeflater::FastDeflater(int run_distance, string* out)
+    : run_distance_(run_distance),
+      out_(out),
+      bits_(0),
+      num_bits_(0),
+      adler_(1) {  // the checksum of no data
+  CHECK(run_distance >= 1 && run_distance <= kMaxRunDistance);
+  input_.reserve(kBlockSize);
+  // CMF: deflate with a 32 KB window.  FLG: fastest level, and a check value
+  // making the pair a multiple of 31.
+  out_->push_back(0x78);
+  out_->push_back(0x01);
+}
+
+void FastDeflater::Add(const unsigned char* data, size_t size) {
+  while (size > 0) {
+    const size_t chunk_size = min(size, kBlockSize - input_.size());
+    input_.insert(input_.end(), data, data + chunk_size);
+    data += chunk_size;
+    size -= chunk_size;
+    if (input_.size() == kBlockSize)
+      WriteBlock(false);
+  }
+}
+
+void FastDeflater::Finish() {
+  WriteBlock(true);
+  for (int shift = 24; shift >= 0; shift -= 8)
+    out_->push_back(static_cast<char>((adler_ >> shift) & 0xff));
+}
+
+void FastDeflater::WriteBlock(bool final) {
+  // Split the input into literals and runs, counting each token.  Runs
+  // don't reach back into the previous block, to keep things simple.
+  const unsigned char* data = input_.empty() ? NULL : &input_[0];
+  const size_t size = input_.size();
+  adler_ = SELECT_CPU_VARIANT(Adler32)(adler_, data, size);
+  // The scratch space is sized for the data actually seen, which is often
+  // much less than a block.  Every byte is at most one token, and every
+  // token takes at most two bytes.
+  if (tokens_.size() < size + 1) {
+    tokens_.resize(size + 1);
+    output_.resize(2 * (size + 1) + kMaxHeaderBytes);
+  }
+  uint16_t* tokens = &tokens_[0];
+  size_t num_tokens = 0;
+  uint32_t token_freqs[kNumTokens] = { 0 };
+  size_t i = 0;
+  for (; i < size && i < static_cast<size_t>(run_distance_); ++i) {
+    tokens[num_tokens++] = data[i];
+    token_freqs[data[i]]++;
+  }
+  while (i < size) {
+    // Skip quickly over literals, which can't start a run.
+    if (i + 8 <= size) {
+      const size_t offset = FindRunStart(data + i, data + i - run_distance_);
+      for (const size_t end = i + offset; i < end; ++i) {
+        tokens[num_tokens++] = data[i];
+        token_freqs[data[i]]++;
+      }
+      if (offset == kRunStartWindow)
+        continue;
+    }
+    const size_t match = CountMatch(data + i, data + i - run_distance_,
+                                    min(size - i, kMaxRunLength));
+    if (match >= kMinRunLength) {
+      tokens[num_tokens++] = kRunToken + match;
+      token_freqs[kRunToken + match]++;
+      i += match;
+      continue;
+    }
+    // No run can start before the first mismatched byte (or at it, since it
+    // differs from the byte |run_distance_| before it), so write those as
+    // literals.
+    const size_t end = min(i + match + 1, size);
+    for (; i < end; ++i) {
+      tokens[num_tokens++] = data[i];
+      token_freqs[data[i]]++;
+    }
+  }
+
+  uint32_t freqs[kNumLiteralLengthSymbols] = { 0 };
+  for (int i = 0; i < kRunToken; ++i)
+    freqs[i] = token_freqs[i];
+  freqs[kEndOfBlock] = 1;
+  for (size_t length = kMinRunLength; length <= kMaxRunLength; ++length) {
+    freqs[kFirstLengthSymbol + GetLengthSymbol(length)] +=
+        token_freqs[kRunToken + length];
+  }
+
+  unsigned char literal_lengths[kNumLiteralLengthSymbols];
+  uint16_t literal_codes[kNumLiteralLengthSymbols];
+  BuildCodeLengths(freqs, kNumLiteralLengthSymbols, kMaxCodeLength,
+                   literal_lengths);
+  GetCanonicalCodes(literal_lengths, kNumLiteralLengthSymbols, literal_codes);
+  int num_literal_lengths = kNumLiteralLengthSymbols;
+  while (literal_lengths[num_literal_lengths - 1] == 0)
+    num_literal_lengths--;
+
+  // Every run is at the same distance, whose symbol (distance - 1) gets the
+  // distance code's only code: a single 0 bit.
+  unsigned char distance_lengths[kMaxRunDistance] = { 0 };
+  distance_lengths[run_distance_ - 1] = 1;
+
+  // Each token's bit string: a literal's code, or a length code, its extra
+  // bits, and the distance code.
+  uint32_t token_codes[kNumTokens];
+  for (int i = 0; i < kRunToken; ++i)
+    token_codes[i] = literal_codes[i] | literal_lengths[i] << kTokenLengthShift;
+  for (size_t length = kMinRunLength; length <= kMaxRunLength; ++length) {
+    const int symbol = GetLengthSymbol(length);
+    const int code_length = literal_lengths[kFirstLengthSymbol + symbol];
+    const uint32_t num_bits = code_length + kLengthExtraBits[symbol] + 1;
+    token_codes[kRunToken + length] =
+        literal_codes[kFirstLengthSymbol + symbol] |
+        (length - kLengthBase[symbol]) << code_length |
+        num_bits << kTokenLengthShift;
+  }
+
+  BitWriter writer(&output_[0], bits_, num_bits_);
+  WriteBlockHeader(final, literal_lengths, num_literal_lengths,
+                   distance_lengths, run_distance_, &writer);
+  const uint32_t code_mask = (1 << kTokenLengthShift) - 1;
+  for (size_t i = 0; i < num_tokens; ++i) {
+    const uint32_t code = token_codes[tokens[i]];
+    writer.Put(code & code_mask, code >> kTokenLengthShift);
+  }
+  writer.Put(literal_codes[kEndOfBlock], literal_lengths[kEndOfBlock]);
+  writer.Flush(final);
+
+  const size_t output_size = writer.out() - &output_[0];
+  DCHECK(output_size <= output_.size());
+  out_->append(reinterpret_cast<const char*>(&output_[0]), output_size);
+  bits_ = writer.bits();
+  num_bits_ = writer.num_bits();
+  input_.clear();
+}
+
+}  // namespace screenshot
@@ -0,0 +1,60 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_FAST_DEFLATE_H_
+#define SCREENSHOT_FAST_DEFLATE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace screenshot {
+
+// Compresses data into a zlib stream several times faster than zlib's
+// fastest level, at some cost in size.  There's no match search: the only
+// symbols used are literals and matches at a single fixed distance (i.e. runs
+// of a repeated byte or pixel), which is most of what filtered PNG rows of
+// screenshots contain.  Input is buffered and written as a series of deflate
+// blocks, each with Huffman codes built from its own symbol counts.
+class FastDeflater {
+ public:
+  // Runs repeat the |run_distance| bytes before them, where |run_distance| is
+  // from 1 to 4; PNG data should use its number of bytes per pixel.
+  // Compressed data is appended to |out|.
+  FastDeflater(int run_distance, std::string* out);
+
+  // Compresses |size| bytes of |data|.
+  void Add(const unsigned char* data, size_t size);
+
+  // Writes any remaining compressed data and the end of the stream.
+  void Finish();
+
+ private:
+  // Compresses the buffered input as a single block, which is the stream's
+  // last block if |final| is true.
+  void WriteBlock(bool final);
+
+  int run_distance_;
+  std::string* out_;  // not owned
+
+  // Uncompressed data that hasn't been written yet.
+  std::vector<unsigned char> input_;
+
+  // Scratch space for WriteBlock(): one symbol per literal or run in a
+  // block, and the block's compressed bytes.
+  std::vector<uint16_t> tokens_;
+  std::vector<unsigned char> output_;
+
+  // Bits that have been written but don't yet fill a byte.
+  uint64_t bits_;
+  int num_bits_;
+
+  // Adler-32 checksum of the uncompressed data so far.
+  uint32_t adler_;
+};
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_FAST_DEFLATE_H_
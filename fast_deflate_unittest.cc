@@ -0,0 +1,210 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "convert.h"
+#include "cpu_dispatch.h"
+#include "image.h"
+#include "image_compare.h"
+#include "png_encoder.h"
+
+using std::string;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// Pixel data for a test image, which Image views point into.
+class TestImage {
+ public:
+  TestImage(int width, int height, bool has_alpha)
+      : pixels_(static_cast<size_t>(width) * height) {
+    image_.data = reinterpret_cast<unsigned char*>(&pixels_[0]);
+    image_.width = width;
+    image_.height = height;
+    image_.stride = width * sizeof(uint32_t);
+    image_.has_alpha = has_alpha;
+  }
+
+  const Image& image() const { return image_; }
+
+  uint32_t& at(int x, int y) {
+    return pixels_[static_cast<size_t>(y) * image_.width + x];
+  }
+
+ private:
+  vector<uint32_t> pixels_;
+  Image image_;
+};
+
+// Returns an opaque pixel with the passed color channels.
+uint32_t MakePixel(int r, int g, int b) {
+  return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+// Encodes |image| with PNG_SPEED_FASTEST using each supported CPU level's
+// kernels, decodes the result with libpng, and checks that it matches the
+// input.
+void ExpectRoundTrip(const Image& image) {
+  RgbImage expected;
+  ConvertImage(image, false, &expected);
+
+  PngOptions options;
+  options.speed = PNG_SPEED_FASTEST;
+
+  char path[] = "/tmp/fast_deflate_unittest.XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+
+  const CpuLevel original_level = GetCpuLevel();
+  for (int level = CPU_LEVEL_BASELINE; level <= GetSupportedCpuLevel();
+       ++level) {
+    SCOPED_TRACE(GetCpuLevelName(static_cast<CpuLevel>(level)));
+    SetCpuLevel(static_cast<CpuLevel>(level));
+
+    string png;
+    ASSERT_TRUE(EncodePng(image, options, &png));
+    {
+      std::ofstream file(path, std::ios::binary);
+      file.write(png.data(), png.size());
+      ASSERT_TRUE(file.good());
+    }
+
+    RgbImage actual;
+    ASSERT_TRUE(ReadPngFile(path, expected.channels, &actual));
+    ASSERT_EQ(expected.width, actual.width);
+    ASSERT_EQ(expected.height, actual.height);
+    EXPECT_EQ(0, CompareImages(actual, expected, 0, NULL));
+  }
+  SetCpuLevel(original_level);
+  unlink(path);
+}
+
+}  // namespace
+
+// A single color throughout, so every row after the first pixel is one
+// long run spanning many maximum-length (258-byte) matches.
+TEST(FastDeflateTest, SolidColor) {
+  TestImage test(1000, 300, false);
+  for (int y = 0; y < 300; ++y) {
+    for (int x = 0; x < 1000; ++x)
+      test.at(x, y) = MakePixel(0x33, 0x66, 0x99);
+  }
+  ExpectRoundTrip(test.image());
+}
+
+// Runs of lengths on either side of the longest single match.
+TEST(FastDeflateTest, RunLengths) {
+  const int kRunLengths[] = {
+    1, 2, 3, 4, 5, 63, 64, 65, 85, 86, 87, 257, 258, 259, 260, 515, 516, 517,
+  };
+  const int kNumRunLengths = sizeof(kRunLengths) / sizeof(kRunLengths[0]);
+  TestImage test(1531, 40, false);
+  for (int y = 0; y < 40; ++y) {
+    int x = 0, run = y % kNumRunLengths, color = y;
+    while (x < 1531) {
+      const uint32_t pixel = MakePixel(color * 37 % 256, color * 11 % 256,
+                                       color * 5 % 256);
+      for (int i = 0; i < kRunLengths[run] && x < 1531; ++i, ++x)
+        test.at(x, y) = pixel;
+      run = (run + 1) % kNumRunLengths;
+      color++;
+    }
+  }
+  ExpectRoundTrip(test.image());
+}
+
+// Channel values from a geometric distribution, so that a few symbols are
+// very common and many are rare, giving codes of very different lengths.
+TEST(FastDeflateTest, SkewedFrequencies) {
+  std::mt19937 rng(1);
+  std::geometric_distribution<int> skewed(0.3);
+  TestImage test(512, 512, false);
+  for (int y = 0; y < 512; ++y) {
+    for (int x = 0; x < 512; ++x) {
+      test.at(x, y) = MakePixel(std::min(skewed(rng), 255),
+                                std::min(skewed(rng), 255),
+                                std::min(skewed(rng), 255));
+    }
+  }
+  ExpectRoundTrip(test.image());
+}
+
+// Mostly background with sparse noise, like text on a page.
+TEST(FastDeflateTest, SparseNoise) {
+  std::mt19937 rng(2);
+  TestImage test(640, 480, false);
+  for (int y = 0; y < 480; ++y) {
+    for (int x = 0; x < 640; ++x) {
+      test.at(x, y) = rng() % 50 ?
+          MakePixel(0xff, 0xff, 0xff) :
+          MakePixel(rng() % 256, rng() % 256, rng() % 256);
+    }
+  }
+  ExpectRoundTrip(test.image());
+}
+
+// Uniformly random pixels, which are almost all literals.  This is also
+// big enough to be split into several blocks.
+TEST(FastDeflateTest, Noise) {
+  std::mt19937 rng(3);
+  TestImage test(1024, 768, false);
+  for (int y = 0; y < 768; ++y) {
+    for (int x = 0; x < 1024; ++x)
+      test.at(x, y) = MakePixel(rng() % 256, rng() % 256, rng() % 256);
+  }
+  ExpectRoundTrip(test.image());
+}
+
+// Premultiplied pixels with varying alpha, written as RGBA.
+TEST(FastDeflateTest, Alpha) {
+  std::mt19937 rng(4);
+  TestImage test(300, 200, true);
+  for (int y = 0; y < 200; ++y) {
+    for (int x = 0; x < 300; ++x) {
+      // Long transparent and opaque runs, with some translucent pixels.
+      const uint32_t alpha =
+          x < 100 ? 0 : (x < 200 ? 0xff : rng() % 256);
+      const uint32_t value = alpha ? (y * 255 / 199) * alpha / 255 : 0;
+      test.at(x, y) = (alpha << 24) | (value << 16) | (value << 8) |
+                      (alpha ? rng() % (alpha + 1) : 0);
+    }
+  }
+  ExpectRoundTrip(test.image());
+}
+
+TEST(FastDeflateTest, OddSizes) {
+  const int kSizes[][2] = {
+    { 1, 1 }, { 1, 300 }, { 300, 1 }, { 7, 3 }, { 333, 17 }, { 65, 65 },
+  };
+  std::mt19937 rng(5);
+  for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); ++i) {
+    const int width = kSizes[i][0], height = kSizes[i][1];
+    SCOPED_TRACE(testing::Message() << width << "x" << height);
+    TestImage test(width, height, false);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        test.at(x, y) = x % 5 ?
+            MakePixel(x % 256, y % 256, (x + y) % 256) :
+            MakePixel(rng() % 256, rng() % 256, rng() % 256);
+      }
+    }
+    ExpectRoundTrip(test.image());
+  }
+}
+
+}  // namespace screenshot
@@ -0,0 +1,53 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_IMAGE_H_
+#define SCREENSHOT_IMAGE_H_
+
+#include <stdint.h>
+
+#include <cstddef>
+
+namespace screenshot {
+
+// A view of 32-bit-per-pixel image data (doesn't own the pixels).  Each
+// pixel is a native-endian 0xAARRGGBB value, which is the ZPixmap layout
+// that X uses for 24- and 32-bit-deep visuals.  When |has_alpha| is false,
+// the top byte of each pixel is undefined and should be ignored; otherwise
+// the color channels are premultiplied by alpha.
+struct Image {
+  Image()
+      : data(NULL),
+        width(0),
+        height(0),
+        stride(0),
+        has_alpha(false) {
+  }
+
+  const uint32_t* Row(int y) const {
+    return reinterpret_cast<const uint32_t*>(
+        data + static_cast<ptrdiff_t>(y) * stride);
+  }
+
+  // Returns a view of the |region_width|x|region_height| region at (|x|,
+  // |y|), which must lie within this image.
+  Image GetRegion(int x, int y, int region_width, int region_height) const {
+    Image region = *this;
+    region.data =
+        data + static_cast<ptrdiff_t>(y) * stride + x * sizeof(uint32_t);
+    region.width = region_width;
+    region.height = region_height;
+    return region;
+  }
+
+  unsigned char* data;
+  int width;
+  int height;
+  int stride;  // bytes per row
+  bool has_alpha;
+};
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_IMAGE_H_
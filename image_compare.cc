@@ -0,0 +1,171 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "image_compare.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <png.h>
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+using std::max;
+using std::min;
+using std::string;
+using std::thread;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// Smallest number of rows worth handing to a thread of their own.
+static const int kMinRowsPerThread = 64;
+
+// Compares one row of |width| pixels, returning the number of mismatches.
+// The per-byte pass has no dependencies between iterations, so the
+// compiler vectorizes it; the per-pixel pass then only has to OR together
+// |kChannels| flags.  |exceeded| is scratch space for |width| * |kChannels|
+// bytes, and |mask| may be NULL.
+template <int kChannels>
+int CompareRow(const unsigned char* actual, const unsigned char* expected,
+               int width, unsigned char tolerance,
+               unsigned char* exceeded, unsigned char* mask) {
+  const int size = width * kChannels;
+  for (int i = 0; i < size; ++i) {
+    const unsigned char diff = max(actual[i], expected[i]) -
+                               min(actual[i], expected[i]);
+    exceeded[i] = diff > tolerance;
+  }
+
+  int num_mismatches = 0;
+  for (int x = 0; x < width; ++x) {
+    unsigned char mismatch = 0;
+    for (int c = 0; c < kChannels; ++c)
+      mismatch |= exceeded[x * kChannels + c];
+    if (mask)
+      mask[x] = mismatch;
+    num_mismatches += mismatch;
+  }
+  return num_mismatches;
+}
+
+// Compares rows [|start_y|, |end_y|) and stores the mismatch count in
+// |num_mismatches|.
+void CompareRows(const RgbImage* actual, const RgbImage* expected,
+                 int tolerance, int start_y, int end_y,
+                 unsigned char* mask, int64_t* num_mismatches) {
+  vector<unsigned char> exceeded(actual->row_size());
+  *num_mismatches = 0;
+  for (int y = start_y; y < end_y; ++y) {
+    unsigned char* mask_row = mask ? mask + y * actual->width : NULL;
+    *num_mismatches += actual->channels == 4 ?
+        CompareRow<4>(actual->Row(y), expected->Row(y), actual->width,
+                      tolerance, &exceeded[0], mask_row) :
+        CompareRow<3>(actual->Row(y), expected->Row(y), actual->width,
+                      tolerance, &exceeded[0], mask_row);
+  }
+}
+
+}  // namespace
+
+bool ReadPngFile(const string& filename, int channels, RgbImage* image) {
+  CHECK(channels == 3 || channels == 4);
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (!file)
+    return false;
+
+  png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png ? png_create_info_struct(png) : NULL;
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    fclose(file);
+    return false;
+  }
+  // Declared before setjmp() so that it's freed if libpng bails out.
+  vector<png_bytep> rows;
+  if (setjmp(png_jmpbuf(png))) {
+    LOG(ERROR) << "Unable to decode " << filename;
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(file);
+    return false;
+  }
+
+  png_init_io(png, file);
+  png_read_info(png, info);
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_gray_to_rgb(png);
+  if (channels == 4)
+    png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+  else
+    png_set_strip_alpha(png);
+  png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  image->width = png_get_image_width(png, info);
+  image->height = png_get_image_height(png, info);
+  image->channels = channels;
+  image->palette_valid = false;
+  image->colors.clear();
+  CHECK_EQ(png_get_rowbytes(png, info), image->row_size());
+  image->data.resize(image->row_size() * image->height);
+  rows.resize(image->height);
+  for (int y = 0; y < image->height; ++y)
+    rows[y] = &image->data[y * image->row_size()];
+  png_read_image(png, &rows[0]);
+  png_read_end(png, NULL);
+
+  png_destroy_read_struct(&png, &info, NULL);
+  fclose(file);
+  return true;
+}
+
+int64_t CompareImages(const RgbImage& actual, const RgbImage& expected,
+                      int tolerance, vector<unsigned char>* mask) {
+  CHECK_EQ(actual.width, expected.width);
+  CHECK_EQ(actual.height, expected.height);
+  CHECK_EQ(actual.channels, expected.channels);
+  tolerance = max(0, min(tolerance, 255));
+
+  unsigned char* mask_data = NULL;
+  if (mask) {
+    mask->assign(static_cast<size_t>(actual.width) * actual.height, 0);
+    mask_data = mask->empty() ? NULL : &(*mask)[0];
+  }
+
+  const int num_threads = max(1, min(
+      static_cast<int>(thread::hardware_concurrency()),
+      actual.height / kMinRowsPerThread));
+  const int rows_per_thread = (actual.height + num_threads - 1) / num_threads;
+  vector<int64_t> num_mismatches(num_threads, 0);
+  vector<thread> threads;
+  for (int i = 1; i < num_threads; ++i) {
+    const int start_y = min(i * rows_per_thread, actual.height);
+    const int end_y = min(start_y + rows_per_thread, actual.height);
+    threads.push_back(thread(CompareRows, &actual, &expected, tolerance,
+                             start_y, end_y, mask_data, &num_mismatches[i]));
+  }
+  CompareRows(&actual, &expected, tolerance,
+              0, min(rows_per_thread, actual.height),
+              mask_data, &num_mismatches[0]);
+
+  int64_t total = num_mismatches[0];
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+    total += num_mismatches[i + 1];
+  }
+  return total;
+}
+
+}  // namespace screenshot
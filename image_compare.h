@@ -0,0 +1,32 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_IMAGE_COMPARE_H_
+#define SCREENSHOT_IMAGE_COMPARE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "convert.h"
+
+namespace screenshot {
+
+// Decodes the PNG file at |filename| into |image| with |channels| (3 or 4)
+// 8-bit channels per pixel, expanding or stripping channels as needed.
+// Returns false on failure.
+bool ReadPngFile(const std::string& filename, int channels, RgbImage* image);
+
+// Compares |actual| against |expected|, which must have the same dimensions
+// and number of channels, and returns the number of pixels with a channel
+// that differs by more than |tolerance|.  If |mask| is non-NULL, it's
+// filled with one byte per pixel: 1 for mismatches and 0 otherwise.  Rows
+// are compared on several threads.
+int64_t CompareImages(const RgbImage& actual, const RgbImage& expected,
+                      int tolerance, std::vector<unsigned char>* mask);
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_IMAGE_COMPARE_H_
@@ -0,0 +1,95 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "jpeg_encoder.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <jpeglib.h>
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+using std::string;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// libjpeg's default error handler exits the process, so we jump back to
+// EncodeJpeg() instead.
+struct ErrorManager {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+};
+
+void HandleError(j_common_ptr cinfo) {
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  LOG(ERROR) << "JPEG encoding failed: " << message;
+  longjmp(reinterpret_cast<ErrorManager*>(cinfo->err)->setjmp_buffer, 1);
+}
+
+}  // namespace
+
+bool EncodeJpeg(const RgbImage& image, int quality, string* out) {
+  if (image.width <= 0 || image.height <= 0)
+    return false;
+
+  struct jpeg_compress_struct cinfo;
+  ErrorManager error_manager;
+  cinfo.err = jpeg_std_error(&error_manager.pub);
+  error_manager.pub.error_exit = HandleError;
+
+  unsigned char* buffer = NULL;
+  unsigned long buffer_size = 0;
+  // RGBA rows need their alpha bytes stripped first.  Declared before
+  // setjmp() so that it's freed if libjpeg bails out.
+  vector<unsigned char> rgb_row(image.channels == 4 ? image.width * 3 : 0);
+  if (setjmp(error_manager.setjmp_buffer)) {
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+    return false;
+  }
+
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &buffer, &buffer_size);
+  cinfo.image_width = image.width;
+  cinfo.image_height = image.height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+
+  while (cinfo.next_scanline < cinfo.image_height) {
+    const unsigned char* src = image.Row(cinfo.next_scanline);
+    JSAMPROW row = const_cast<JSAMPROW>(src);
+    if (image.channels == 4) {
+      for (int x = 0; x < image.width; ++x) {
+        rgb_row[x * 3] = src[x * 4];
+        rgb_row[x * 3 + 1] = src[x * 4 + 1];
+        rgb_row[x * 3 + 2] = src[x * 4 + 2];
+      }
+      row = &rgb_row[0];
+    }
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  out->append(reinterpret_cast<const char*>(buffer), buffer_size);
+  free(buffer);
+  return true;
+}
+
+}  // namespace screenshot
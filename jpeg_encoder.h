@@ -0,0 +1,21 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_JPEG_ENCODER_H_
+#define SCREENSHOT_JPEG_ENCODER_H_
+
+#include <string>
+
+#include "convert.h"
+
+namespace screenshot {
+
+// Encodes |image| as a JPEG file with the given quality (from 0 to 100) and
+// appends it to |out|.  Any alpha channel is discarded.  Returns false on
+// failure.
+bool EncodeJpeg(const RgbImage& image, int quality, std::string* out);
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_JPEG_ENCODER_H_
@@ -0,0 +1,748 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "png_encoder.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+#include "cpu_dispatch.h"
+#include "fast_deflate.h"
+
+using std::fill;
+using std::max;
+using std::min;
+using std::string;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// Signature that starts every PNG file.
+static const unsigned char kPngSignature[] = {
+  0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+};
+
+// PNG color types (from the IHDR chunk).
+static const int kColorTypeRgb = 2;
+static const int kColorTypeIndexed = 3;
+static const int kColorTypeRgba = 6;
+
+// PNG row filter types.
+static const int kFilterNone = 0;
+static const int kFilterSub = 1;
+static const int kFilterUp = 2;
+static const int kFilterAverage = 3;
+static const int kFilterPaeth = 4;
+static const int kNumFilters = 5;
+
+// Size of the buffer that compressed data is collected in before being
+// written as an IDAT chunk.
+static const size_t kIdatChunkSize = 64 * 1024;
+
+// Settings tried by TunePngOptions(), from fastest to slowest.
+struct TuningCandidate {
+  PngSpeed speed;
+  int compression_level;
+};
+static const TuningCandidate kTuningCandidates[] = {
+  { PNG_SPEED_FASTEST, Z_DEFAULT_COMPRESSION },
+  { PNG_SPEED_DEFAULT, 1 },
+  { PNG_SPEED_DEFAULT, 3 },
+  { PNG_SPEED_DEFAULT, 6 },
+  { PNG_SPEED_DEFAULT, 9 },
+};
+
+// Fraction of the image's rows (but at least kMinTuningRows) that
+// TunePngOptions() encodes with each candidate.
+static const int kTuningRowDivisor = 8;
+static const int kMinTuningRows = 32;
+
+uint64_t GetMonotonicTimeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Returns a description of |options|' speed and compression level.
+string DescribePngOptions(const PngOptions& options) {
+  if (options.speed == PNG_SPEED_FASTEST)
+    return "fastest";
+  std::ostringstream description;
+  description << "zlib level " << options.compression_level;
+  return description.str();
+}
+
+void AppendUint32(uint32_t value, string* out) {
+  out->push_back(static_cast<char>((value >> 24) & 0xff));
+  out->push_back(static_cast<char>((value >> 16) & 0xff));
+  out->push_back(static_cast<char>((value >> 8) & 0xff));
+  out->push_back(static_cast<char>(value & 0xff));
+}
+
+// Appends a chunk with the given four-character type and payload to |out|.
+void AppendChunk(const char* type,
+                 const unsigned char* data, size_t size,
+                 string* out) {
+  AppendUint32(size, out);
+  out->append(type, 4);
+  uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+  if (size) {
+    out->append(reinterpret_cast<const char*>(data), size);
+    crc = crc32(crc, data, size);
+  }
+  AppendUint32(crc, out);
+}
+
+void AppendHeader(int width, int height, int bit_depth, int color_type,
+                  string* out) {
+  string header;
+  AppendUint32(width, &header);
+  AppendUint32(height, &header);
+  header.push_back(bit_depth);
+  header.push_back(color_type);
+  header.push_back(0);  // compression method
+  header.push_back(0);  // filter method
+  header.push_back(0);  // interlace method
+  AppendChunk("IHDR",
+              reinterpret_cast<const unsigned char*>(header.data()),
+              header.size(), out);
+}
+
+// Compresses filtered scanlines and appends them to a PNG as IDAT chunks, or
+// as APNG fdAT chunks if |sequence_number| is non-NULL.  In the latter case,
+// |sequence_number| is used for the first chunk and incremented after each.
+// |strategy| is passed to zlib, which isn't used with PNG_SPEED_FASTEST.
+// |bytes_per_pixel| is the distance between corresponding bytes of adjacent
+// pixels (1 for indexed data).
+class ImageDataWriter {
+ public:
+  ImageDataWriter(const PngOptions& options, int strategy,
+                  int bytes_per_pixel, uint32_t* sequence_number, string* out)
+      : out_(out),
+        sequence_number_(sequence_number),
+        buffer_(kIdatChunkSize) {
+    if (options.speed == PNG_SPEED_FASTEST) {
+      fast_deflater_.reset(new FastDeflater(bytes_per_pixel, &fast_output_));
+      return;
+    }
+    stream_.zalloc = Z_NULL;
+    stream_.zfree = Z_NULL;
+    stream_.opaque = Z_NULL;
+    CHECK(deflateInit2(&stream_, options.compression_level, Z_DEFLATED,
+                       15,  // window_bits
+                       8,   // mem_level
+                       strategy) == Z_OK);
+    stream_.next_out = &buffer_[kSequenceNumberSize];
+    stream_.avail_out = buffer_.size() - kSequenceNumberSize;
+  }
+
+  ~ImageDataWriter() {
+    if (!fast_deflater_)
+      deflateEnd(&stream_);
+  }
+
+  // Compresses a filter-type byte followed by |size| bytes of row data.
+  void AddRow(unsigned char filter, const unsigned char* row, size_t size) {
+    if (fast_deflater_) {
+      fast_deflater_->Add(&filter, 1);
+      fast_deflater_->Add(row, size);
+      FlushFastOutput(false);
+      return;
+    }
+    Deflate(&filter, 1, Z_NO_FLUSH);
+    Deflate(row, size, Z_NO_FLUSH);
+  }
+
+  // Flushes all remaining compressed data.
+  void Finish() {
+    if (fast_deflater_) {
+      fast_deflater_->Finish();
+      FlushFastOutput(true);
+      return;
+    }
+    Deflate(NULL, 0, Z_FINISH);
+    FlushChunk();
+  }
+
+ private:
+  // Writes full chunks of |fast_output_|, or all of it if |all| is true.
+  void FlushFastOutput(bool all) {
+    const size_t chunk_capacity = buffer_.size() - kSequenceNumberSize;
+    size_t offset = 0;
+    while (fast_output_.size() - offset >= chunk_capacity ||
+           (all && offset < fast_output_.size())) {
+      const size_t size = min(chunk_capacity, fast_output_.size() - offset);
+      memcpy(&buffer_[kSequenceNumberSize], fast_output_.data() + offset,
+             size);
+      WriteChunk(size);
+      offset += size;
+    }
+    fast_output_.erase(0, offset);
+  }
+
+  void Deflate(const unsigned char* data, size_t size, int flush) {
+    stream_.next_in = const_cast<Bytef*>(data);
+    stream_.avail_in = size;
+    while (true) {
+      const int result = deflate(&stream_, flush);
+      CHECK(result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR)
+          << "deflate() failed: " << result;
+      if (stream_.avail_out == 0) {
+        FlushChunk();
+        continue;
+      }
+      if (flush == Z_FINISH ? result == Z_STREAM_END : stream_.avail_in == 0)
+        break;
+    }
+  }
+
+  void FlushChunk() {
+    WriteChunk(buffer_.size() - kSequenceNumberSize - stream_.avail_out);
+    stream_.next_out = &buffer_[kSequenceNumberSize];
+    stream_.avail_out = buffer_.size() - kSequenceNumberSize;
+  }
+
+  // Writes the |size| bytes of compressed data that follow the space for the
+  // sequence number in |buffer_|.
+  void WriteChunk(size_t size) {
+    if (!size)
+      return;
+    if (sequence_number_) {
+      // fdAT chunks are IDAT chunks prefixed by a sequence number.
+      string prefix;
+      AppendUint32((*sequence_number_)++, &prefix);
+      memcpy(&buffer_[0], prefix.data(), kSequenceNumberSize);
+      AppendChunk("fdAT", &buffer_[0], kSequenceNumberSize + size, out_);
+    } else {
+      AppendChunk("IDAT", &buffer_[kSequenceNumberSize], size, out_);
+    }
+  }
+
+  // Space reserved at the start of |buffer_| for an fdAT sequence number.
+  static const size_t kSequenceNumberSize = 4;
+
+  string* out_;  // not owned
+  uint32_t* sequence_number_;  // not owned; may be NULL
+  z_stream stream_;  // only initialized if |fast_deflater_| is NULL
+  vector<unsigned char> buffer_;
+
+  // Used instead of |stream_| for PNG_SPEED_FASTEST.  Its output is
+  // collected in |fast_output_| until there's enough for a chunk.
+  std::unique_ptr<FastDeflater> fast_deflater_;
+  string fast_output_;
+};
+
+// Filter kernels.  Each filters bytes [|bpp|, |size|) of |row| into |out|,
+// given the previous row |prev| (all zeros for the first row).  The first
+// pixel, which has no left neighbor, is handled by FilterRow().
+KERNEL_IMPL void SubFilterImpl(const unsigned char* __restrict row,
+                               const unsigned char* __restrict prev,
+                               size_t size, int bpp,
+                               unsigned char* __restrict out) {
+  for (size_t i = bpp; i < size; ++i)
+    out[i] = row[i] - row[i - bpp];
+}
+
+KERNEL_IMPL void UpFilterImpl(const unsigned char* __restrict row,
+                              const unsigned char* __restrict prev,
+                              size_t size, int bpp,
+                              unsigned char* __restrict out) {
+  for (size_t i = bpp; i < size; ++i)
+    out[i] = row[i] - prev[i];
+}
+
+KERNEL_IMPL void AverageFilterImpl(const unsigned char* __restrict row,
+                                   const unsigned char* __restrict prev,
+                                   size_t size, int bpp,
+                                   unsigned char* __restrict out) {
+  for (size_t i = bpp; i < size; ++i)
+    out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+}
+
+KERNEL_IMPL void PaethFilterImpl(const unsigned char* __restrict row,
+                                 const unsigned char* __restrict prev,
+                                 size_t size, int bpp,
+                                 unsigned char* __restrict out) {
+  for (size_t i = bpp; i < size; ++i) {
+    const int a = row[i - bpp];
+    const int b = prev[i];
+    const int c = prev[i - bpp];
+    // The distances from the initial estimate a + b - c to each neighbor,
+    // computed without the estimate so that the loop is branch-free.
+    const int pa = abs(b - c);
+    const int pb = abs(a - c);
+    const int pc = abs(a + b - 2 * c);
+    const int predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+    out[i] = row[i] - predictor;
+  }
+}
+
+// Returns the sum of the absolute values of |row|'s bytes when interpreted as
+// signed values.  The filter that minimizes this tends to compress best.
+// Rows are at most 4 * 32767 bytes, so 32 bits can't overflow.
+KERNEL_IMPL uint64_t SumAbsoluteValuesImpl(const unsigned char* __restrict row,
+                                           size_t size) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < size; ++i) {
+    const unsigned char negated = -row[i];
+    sum += min(row[i], negated);
+  }
+  return sum;
+}
+
+// Converts a row of |width| opaque pixels to RGBA for a delta frame.  Pixels
+// that match |prev| become transparent black, so that blending the frame over
+// the previous one leaves them alone, and the rest become opaque.  If
+// |all_changed| is 1, every pixel is treated as changed.
+KERNEL_IMPL void ConvertDeltaRowImpl(const uint32_t* __restrict row,
+                                     const uint32_t* __restrict prev,
+                                     int width, uint32_t all_changed,
+                                     unsigned char* __restrict out) {
+  for (int x = 0; x < width; ++x) {
+    const uint32_t pixel = row[x];
+    const uint32_t changed = ((pixel ^ prev[x]) & 0x00ffffff) | all_changed;
+    const uint32_t mask = changed ? 0xff : 0;
+    out[x * 4] = (pixel >> 16) & mask;
+    out[x * 4 + 1] = (pixel >> 8) & mask;
+    out[x * 4 + 2] = pixel & mask;
+    out[x * 4 + 3] = mask;
+  }
+}
+
+DEFINE_CPU_VARIANTS(void, SubFilter,
+                    (const unsigned char* row, const unsigned char* prev,
+                     size_t size, int bpp, unsigned char* out),
+                    (row, prev, size, bpp, out))
+DEFINE_CPU_VARIANTS(void, UpFilter,
+                    (const unsigned char* row, const unsigned char* prev,
+                     size_t size, int bpp, unsigned char* out),
+                    (row, prev, size, bpp, out))
+DEFINE_CPU_VARIANTS(void, AverageFilter,
+                    (const unsigned char* row, const unsigned char* prev,
+                     size_t size, int bpp, unsigned char* out),
+                    (row, prev, size, bpp, out))
+DEFINE_CPU_VARIANTS(void, PaethFilter,
+                    (const unsigned char* row, const unsigned char* prev,
+                     size_t size, int bpp, unsigned char* out),
+                    (row, prev, size, bpp, out))
+DEFINE_CPU_VARIANTS(uint64_t, SumAbsoluteValues,
+                    (const unsigned char* row, size_t size),
+                    (row, size))
+DEFINE_CPU_VARIANTS(void, ConvertDeltaRow,
+                    (const uint32_t* row, const uint32_t* prev, int width,
+                     uint32_t all_changed, unsigned char* out),
+                    (row, prev, width, all_changed, out))
+
+typedef void (*FilterKernel)(const unsigned char* row,
+                             const unsigned char* prev,
+                             size_t size, int bpp, unsigned char* out);
+
+// The filter kernels for the current CPU level.
+struct FilterKernels {
+  FilterKernels()
+      : sum_absolute_values(SELECT_CPU_VARIANT(SumAbsoluteValues)) {
+    filters[kFilterNone] = NULL;
+    filters[kFilterSub] = SELECT_CPU_VARIANT(SubFilter);
+    filters[kFilterUp] = SELECT_CPU_VARIANT(UpFilter);
+    filters[kFilterAverage] = SELECT_CPU_VARIANT(AverageFilter);
+    filters[kFilterPaeth] = SELECT_CPU_VARIANT(PaethFilter);
+  }
+
+  FilterKernel filters[kNumFilters];  // indexed by filter type
+  uint64_t (*sum_absolute_values)(const unsigned char* row, size_t size);
+};
+
+// Applies |filter| to |row| (with the previous unfiltered row |prev|, which
+// is all zeros for the first row), writing |size| bytes to |out|.  |bpp| is
+// the number of bytes per complete pixel.
+void FilterRow(const FilterKernels& kernels, int filter,
+               const unsigned char* row, const unsigned char* prev,
+               size_t size, int bpp, unsigned char* out) {
+  if (filter == kFilterNone) {
+    memcpy(out, row, size);
+    return;
+  }
+
+  // Without a left neighbor, Sub predicts zero, Average predicts half of the
+  // byte above, and Up and Paeth predict the byte above.
+  const size_t first_pixel_size = min(size, static_cast<size_t>(bpp));
+  for (size_t i = 0; i < first_pixel_size; ++i) {
+    switch (filter) {
+      case kFilterSub:     out[i] = row[i]; break;
+      case kFilterUp:      out[i] = row[i] - prev[i]; break;
+      case kFilterAverage: out[i] = row[i] - prev[i] / 2; break;
+      case kFilterPaeth:   out[i] = row[i] - prev[i]; break;
+    }
+  }
+  kernels.filters[filter](row, prev, size, bpp, out);
+}
+
+// Filters tried for each row at each PngSpeed.  Sub and Up are the cheapest,
+// and between them they handle flat areas and edges well.
+static const int kAllFilters[] = {
+  kFilterNone, kFilterSub, kFilterUp, kFilterAverage, kFilterPaeth
+};
+static const int kFastFilters[] = { kFilterSub, kFilterUp };
+
+// Filters and compresses truecolor rows, choosing the best filter for each
+// from those allowed by |speed|.
+void WriteTruecolorData(const RgbImage& image, PngSpeed speed,
+                        ImageDataWriter* writer) {
+  const int* filters = kAllFilters;
+  int num_filters = sizeof(kAllFilters) / sizeof(kAllFilters[0]);
+  if (speed == PNG_SPEED_FASTEST) {
+    filters = kFastFilters;
+    num_filters = sizeof(kFastFilters) / sizeof(kFastFilters[0]);
+  }
+
+  const size_t row_size = image.row_size();
+  const int bpp = image.channels;
+  const FilterKernels kernels;
+  vector<unsigned char> candidates[kNumFilters];
+  for (int i = 0; i < kNumFilters; ++i)
+    candidates[i].resize(row_size);
+  const vector<unsigned char> zero_row(row_size, 0);
+
+  for (int y = 0; y < image.height; ++y) {
+    const unsigned char* row = image.Row(y);
+    const unsigned char* prev = y > 0 ? image.Row(y - 1) : &zero_row[0];
+    int best_filter = kFilterNone;
+    uint64_t best_sum = 0;
+    for (int i = 0; i < num_filters; ++i) {
+      const int filter = filters[i];
+      FilterRow(kernels, filter, row, prev, row_size, bpp,
+                &candidates[filter][0]);
+      const uint64_t sum =
+          kernels.sum_absolute_values(&candidates[filter][0], row_size);
+      if (i == 0 || sum < best_sum) {
+        best_filter = filter;
+        best_sum = sum;
+      }
+    }
+    writer->AddRow(best_filter, &candidates[best_filter][0], row_size);
+  }
+}
+
+// Returns the smallest PNG bit depth that can index |num_colors| colors.
+int GetPaletteBitDepth(int num_colors) {
+  if (num_colors <= 2)
+    return 1;
+  if (num_colors <= 4)
+    return 2;
+  if (num_colors <= 16)
+    return 4;
+  return 8;
+}
+
+// Writes the PLTE and (if needed) tRNS chunks describing |table|.
+void AppendPalette(const ColorTable& table, string* out) {
+  vector<unsigned char> palette;
+  vector<unsigned char> alphas;
+  bool has_transparency = false;
+  for (int i = 0; i < table.num_colors(); ++i) {
+    const uint32_t color = table.color(i);
+    palette.push_back((color >> 16) & 0xff);
+    palette.push_back((color >> 8) & 0xff);
+    palette.push_back(color & 0xff);
+    alphas.push_back(color >> 24);
+    if (alphas.back() != 0xff)
+      has_transparency = true;
+  }
+  AppendChunk("PLTE", &palette[0], palette.size(), out);
+
+  if (has_transparency) {
+    // Trailing opaque entries may be omitted.
+    while (!alphas.empty() && alphas.back() == 0xff)
+      alphas.pop_back();
+    AppendChunk("tRNS", &alphas[0], alphas.size(), out);
+  }
+}
+
+// Packs palette indexes for the pixels in |image| (whose colors must all be
+// present in |table|) and compresses them.  The PNG spec recommends leaving
+// indexed rows unfiltered.
+void WriteIndexedData(const RgbImage& image, int bit_depth, ColorTable* table,
+                      ImageDataWriter* writer) {
+  const int bpp = image.channels;
+  const int pixels_per_byte = 8 / bit_depth;
+  const size_t row_size =
+      (image.width + pixels_per_byte - 1) / pixels_per_byte;
+  vector<unsigned char> row(row_size);
+
+  for (int y = 0; y < image.height; ++y) {
+    fill(row.begin(), row.end(), 0);
+    const unsigned char* src = image.Row(y);
+    for (int x = 0; x < image.width; ++x, src += bpp) {
+      const uint32_t alpha = bpp == 4 ? src[3] : 0xff;
+      const uint32_t color =
+          (alpha << 24) | (src[0] << 16) | (src[1] << 8) | src[2];
+      const int index = table->Insert(color);
+      DCHECK(index >= 0);
+      const int shift = 8 - bit_depth * (x % pixels_per_byte + 1);
+      row[x / pixels_per_byte] |= index << shift;
+    }
+    writer->AddRow(kFilterNone, &row[0], row_size);
+  }
+}
+
+// Converts |image|, which must be opaque, to an RGBA delta frame against
+// |previous| (which may be NULL to keep every pixel) with ConvertDeltaRow().
+void ConvertDeltaFrame(const Image& image, const Image* previous,
+                       RgbImage* out) {
+  out->width = image.width;
+  out->height = image.height;
+  out->channels = 4;
+  out->data.resize(out->row_size() * out->height);
+  out->palette_valid = false;
+  out->colors.clear();
+
+  void (*convert_delta_row)(const uint32_t*, const uint32_t*, int, uint32_t,
+                            unsigned char*) =
+      SELECT_CPU_VARIANT(ConvertDeltaRow);
+  for (int y = 0; y < image.height; ++y) {
+    const uint32_t* row = image.Row(y);
+    convert_delta_row(row, previous ? previous->Row(y) : row, image.width,
+                      previous ? 0 : 1, &out->data[y * out->row_size()]);
+  }
+}
+
+// Finds the bounding box of the pixels that differ between |image| and
+// |previous|, which must have the same dimensions.  Returns false if the
+// images are identical.
+bool GetChangedRegion(const Image& image, const Image& previous,
+                      int* x, int* y, int* width, int* height) {
+  const uint32_t mask = image.has_alpha ? 0xffffffff : 0x00ffffff;
+  const size_t row_bytes = image.width * sizeof(uint32_t);
+  int top = 0, bottom = image.height - 1;
+  while (top <= bottom &&
+         memcmp(image.Row(top), previous.Row(top), row_bytes) == 0)
+    top++;
+  if (top > bottom)
+    return false;
+  while (memcmp(image.Row(bottom), previous.Row(bottom), row_bytes) == 0)
+    bottom--;
+
+  int left = image.width, right = -1;
+  for (int row = top; row <= bottom; ++row) {
+    const uint32_t* cur = image.Row(row);
+    const uint32_t* prev = previous.Row(row);
+    for (int col = 0; col < left; ++col) {
+      if ((cur[col] ^ prev[col]) & mask) {
+        left = col;
+        break;
+      }
+    }
+    for (int col = image.width - 1; col > right; --col) {
+      if ((cur[col] ^ prev[col]) & mask) {
+        right = col;
+        break;
+      }
+    }
+  }
+  // The rows may have differed only in ignored alpha bytes.
+  if (right < left)
+    return false;
+
+  *x = left;
+  *y = top;
+  *width = right - left + 1;
+  *height = bottom - top + 1;
+  return true;
+}
+
+}  // namespace
+
+bool EncodePng(const Image& image, const PngOptions& options, string* out) {
+  // Count the image's colors during conversion so that we can decide
+  // whether a palette can be used.
+  RgbImage rgb;
+  ConvertImage(image, MayUsePalette(options), &rgb);
+  return EncodePng(rgb, options, out);
+}
+
+bool EncodePng(const RgbImage& image, const PngOptions& options, string* out) {
+  if (image.width <= 0 || image.height <= 0)
+    return false;
+
+  out->append(reinterpret_cast<const char*>(kPngSignature),
+              sizeof(kPngSignature));
+
+  if (MayUsePalette(options) && image.palette_valid) {
+    ColorTable table;
+    for (size_t i = 0; i < image.colors.size(); ++i)
+      table.Insert(image.colors[i]);
+    const int bit_depth = GetPaletteBitDepth(table.num_colors());
+    VLOG(1) << "Writing indexed PNG with " << table.num_colors()
+            << " color(s) at bit depth " << bit_depth;
+    AppendHeader(image.width, image.height, bit_depth, kColorTypeIndexed, out);
+    AppendPalette(table, out);
+    ImageDataWriter writer(options, Z_DEFAULT_STRATEGY, 1, NULL, out);
+    WriteIndexedData(image, bit_depth, &table, &writer);
+    writer.Finish();
+  } else {
+    VLOG(1) << "Writing truecolor PNG";
+    AppendHeader(image.width, image.height, 8,
+                 image.channels == 4 ? kColorTypeRgba : kColorTypeRgb, out);
+    ImageDataWriter writer(options, Z_FILTERED, image.channels, NULL, out);
+    WriteTruecolorData(image, options.speed, &writer);
+    writer.Finish();
+  }
+
+  AppendChunk("IEND", NULL, 0, out);
+  return true;
+}
+
+bool MayUsePalette(const PngOptions& options) {
+  return options.palette_mode == PALETTE_AUTO &&
+         options.speed != PNG_SPEED_FASTEST;
+}
+
+PngOptions TunePngOptions(const RgbImage& image, const PngOptions& options,
+                          int64_t budget_us) {
+  RgbImage band;
+  band.width = image.width;
+  band.height = min(image.height,
+                    max(image.height / kTuningRowDivisor, kMinTuningRows));
+  band.channels = image.channels;
+  const int start_y = (image.height - band.height) / 2;
+  const unsigned char* start = image.data.empty() ? NULL : image.Row(start_y);
+  band.data.assign(start, start + band.row_size() * band.height);
+  band.palette_valid = image.palette_valid;
+  band.colors = image.colors;
+  const double scale =
+      band.height ? static_cast<double>(image.height) / band.height : 1;
+
+  PngOptions best = options;
+  int64_t best_time_us = 0, best_size = 0;
+  const int num_candidates =
+      sizeof(kTuningCandidates) / sizeof(kTuningCandidates[0]);
+  for (int i = 0; i < num_candidates; ++i) {
+    PngOptions candidate = options;
+    candidate.speed = kTuningCandidates[i].speed;
+    candidate.compression_level = kTuningCandidates[i].compression_level;
+    string encoded;
+    const uint64_t start_time_us = GetMonotonicTimeUs();
+    EncodePng(band, candidate, &encoded);
+    const int64_t time_us = (GetMonotonicTimeUs() - start_time_us) * scale;
+    const int64_t size = encoded.size() * scale;
+    VLOG(1) << "Auto-tune: " << DescribePngOptions(candidate)
+            << " would take about " << time_us << " us for " << size
+            << " bytes";
+    // The candidates get slower, so stop at the first that doesn't fit
+    // (but always keep the first).
+    if (i > 0 && time_us > budget_us)
+      break;
+    if (i == 0 || size < best_size) {
+      best = candidate;
+      best_time_us = time_us;
+      best_size = size;
+    }
+  }
+
+  LOG(INFO) << "Auto-tune: using " << DescribePngOptions(best)
+            << " (about " << best_time_us << " us and " << best_size
+            << " bytes, from a " << band.height << "-row sample) for a "
+            << budget_us << " us budget"
+            << (best_time_us > budget_us ? ", which nothing fits" : "");
+  return best;
+}
+
+AnimatedPngEncoder::AnimatedPngEncoder(int num_frames,
+                                       const PngOptions& options,
+                                       bool delta_frames)
+    : num_frames_(num_frames),
+      options_(options),
+      delta_frames_(delta_frames),
+      frames_added_(0),
+      sequence_number_(0) {
+}
+
+void AnimatedPngEncoder::AddFrame(const Image& frame,
+                                  const Image* previous,
+                                  int delay_ms,
+                                  string* out) {
+  DCHECK(frames_added_ < num_frames_);
+  if (frames_added_ == 0) {
+    out->append(reinterpret_cast<const char*>(kPngSignature),
+                sizeof(kPngSignature));
+    AppendHeader(frame.width, frame.height, 8,
+                 frame.has_alpha || delta_frames_ ? kColorTypeRgba :
+                                                    kColorTypeRgb,
+                 out);
+    string control;
+    AppendUint32(num_frames_, &control);
+    AppendUint32(0, &control);  // num_plays (0 means loop forever)
+    AppendChunk("acTL",
+                reinterpret_cast<const unsigned char*>(control.data()),
+                control.size(), out);
+  }
+
+  // Later frames only need to cover the pixels that changed.  Frames that
+  // didn't change at all still need a (minimal) region to hold their delay.
+  int x = 0, y = 0, width = frame.width, height = frame.height;
+  if (previous &&
+      !GetChangedRegion(frame, *previous, &x, &y, &width, &height)) {
+    width = height = 1;
+  }
+
+  // Frames with their own alpha can't be blended: a translucent pixel needs
+  // to replace the previous one rather than be composited over it.
+  const bool delta = delta_frames_ && !frame.has_alpha;
+  const bool blend = delta && previous;
+
+  string control;
+  AppendUint32(sequence_number_++, &control);
+  AppendUint32(width, &control);
+  AppendUint32(height, &control);
+  AppendUint32(x, &control);
+  AppendUint32(y, &control);
+  const int delay_num = min(delay_ms, 0xffff);
+  control.push_back(static_cast<char>(delay_num >> 8));
+  control.push_back(static_cast<char>(delay_num & 0xff));
+  control.push_back(static_cast<char>(1000 >> 8));  // delay_den
+  control.push_back(static_cast<char>(1000 & 0xff));
+  control.push_back(0);  // dispose_op: APNG_DISPOSE_OP_NONE
+  // blend_op: APNG_BLEND_OP_OVER or APNG_BLEND_OP_SOURCE
+  control.push_back(blend ? 1 : 0);
+  AppendChunk("fcTL",
+              reinterpret_cast<const unsigned char*>(control.data()),
+              control.size(), out);
+
+  RgbImage rgb;
+  const Image region = frame.GetRegion(x, y, width, height);
+  if (delta) {
+    const Image previous_region =
+        previous ? previous->GetRegion(x, y, width, height) : Image();
+    ConvertDeltaFrame(region, previous ? &previous_region : NULL, &rgb);
+  } else {
+    ConvertImage(region, false, &rgb);
+  }
+  ImageDataWriter writer(options_, Z_FILTERED, rgb.channels,
+                         frames_added_ ? &sequence_number_ : NULL, out);
+  WriteTruecolorData(rgb, options_.speed, &writer);
+  writer.Finish();
+  frames_added_++;
+}
+
+void AnimatedPngEncoder::Finish(string* out) {
+  DCHECK(frames_added_ == num_frames_);
+  AppendChunk("IEND", NULL, 0, out);
+}
+
+}  // namespace screenshot
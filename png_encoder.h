@@ -0,0 +1,113 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_PNG_ENCODER_H_
+#define SCREENSHOT_PNG_ENCODER_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include <zlib.h>
+
+#include "convert.h"
+#include "image.h"
+
+namespace screenshot {
+
+// Controls how EncodePng() chooses the PNG color type.
+enum PaletteMode {
+  // Write an indexed PNG if the image has few enough colors.
+  PALETTE_AUTO,
+  // Always write a truecolor PNG.
+  PALETTE_NEVER,
+};
+
+// Controls the trade-off between encoding speed and file size.
+enum PngSpeed {
+  // Choose a filter for each row from all five, and compress with zlib.
+  PNG_SPEED_DEFAULT,
+  // Choose between the Sub and Up filters only, and compress with
+  // FastDeflater instead of zlib.  Palettes are never used, since counting
+  // colors would take longer than the encoding itself.  Files are larger.
+  PNG_SPEED_FASTEST,
+};
+
+struct PngOptions {
+  PngOptions()
+      : palette_mode(PALETTE_AUTO),
+        speed(PNG_SPEED_DEFAULT),
+        compression_level(Z_DEFAULT_COMPRESSION) {
+  }
+
+  PaletteMode palette_mode;
+  PngSpeed speed;
+
+  // zlib compression level, from 0 to 9 (or Z_DEFAULT_COMPRESSION).  Unused
+  // with PNG_SPEED_FASTEST.
+  int compression_level;
+};
+
+// Encodes |image| as a PNG file and appends it to |out|.  Images with alpha
+// are written as RGBA and others as RGB, unless |options| permits a palette
+// and the image contains at most 256 distinct colors, in which case an
+// indexed image with the smallest sufficient bit depth is written instead.
+// Returns false on failure.
+bool EncodePng(const Image& image, const PngOptions& options, std::string* out);
+
+// Like the above, but for an already-converted image.  A palette is only
+// used if |image| was converted with its colors counted.
+bool EncodePng(const RgbImage& image, const PngOptions& options,
+               std::string* out);
+
+// Returns true if |options| allow EncodePng() to write an indexed image,
+// i.e. if it's worth counting colors when converting images for it.
+bool MayUsePalette(const PngOptions& options);
+
+// Picks the settings expected to give the smallest PNG of |image| while
+// encoding it in at most |budget_us| microseconds, starting from |options|.
+// A band from the middle of the image is encoded with progressively slower
+// settings until the time extrapolated to the full image exceeds the budget.
+// If nothing fits, the fastest settings are returned.  The decision is
+// logged.
+PngOptions TunePngOptions(const RgbImage& image, const PngOptions& options,
+                          int64_t budget_us);
+
+// Writes an animated PNG (APNG) one frame at a time.  Each frame after the
+// first only stores the bounding box of the pixels that changed since the
+// previous frame.  Frames are always written as truecolor, since they must
+// all share the color type chosen in the header.
+class AnimatedPngEncoder {
+ public:
+  // |num_frames| is the number of times that AddFrame() will be called.  If
+  // |delta_frames| is true, the file is written as RGBA and pixels of opaque
+  // frames that didn't change are made transparent, with each frame blended
+  // over the previous one.  Runs of unchanged pixels then compress to almost
+  // nothing, which usually outweighs the cost of the extra channel.
+  AnimatedPngEncoder(int num_frames, const PngOptions& options,
+                     bool delta_frames);
+
+  // Encodes |frame| and appends it to |out|, preceded by the PNG header if
+  // this is the first frame.  |previous| must be the frame passed to the
+  // previous call, or NULL for the first frame; all frames must have the
+  // same dimensions.  The frame is displayed for |delay_ms| milliseconds.
+  void AddFrame(const Image& frame, const Image* previous, int delay_ms,
+                std::string* out);
+
+  // Appends the end of the file to |out|.
+  void Finish(std::string* out);
+
+ private:
+  int num_frames_;
+  PngOptions options_;
+  bool delta_frames_;
+  int frames_added_;
+
+  // Sequence number for the next fcTL or fdAT chunk.
+  uint32_t sequence_number_;
+};
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_PNG_ENCODER_H_
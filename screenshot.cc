@@ -2,21 +2,33 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <cctype>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <functional>
 #include <limits>
+#include <mutex>
 #include <sstream>
+#include <string>
+#include <sys/select.h>
 #include <sys/time.h>
+#include <thread>
+#include <vector>
 
-#include <cairo/cairo.h>
 #include <gflags/gflags.h>
 #include <X11/cursorfont.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/shape.h>
 
 #ifdef USE_GLOG
 #include <glog/logging.h>
@@ -24,25 +36,179 @@
 #include "base/logging.h"
 #endif
 
+#include "async_writer.h"
+#include "capture_pool.h"
+#include "clipboard.h"
+#include "convert.h"
+#include "cpu_dispatch.h"
+#include "image.h"
+#include "image_compare.h"
+#include "jpeg_encoder.h"
+#include "png_encoder.h"
+#include "tile_store.h"
+#include "window_finder.h"
+
 DEFINE_string(window, "",
               "Window to capture, as a hexadecimal X ID "
               "(if empty, the root window is captured)");
 
+DEFINE_string(window_name, "",
+              "Capture the topmost window with this title, instead of "
+              "passing its ID with --window");
+
+DEFINE_string(window_class, "",
+              "Capture the topmost window with this WM_CLASS instance or "
+              "class name, instead of passing its ID with --window");
+
 DEFINE_bool(region, false,
             "Use the mouse to select a region of the screen to capture");
 
+DEFINE_bool(active, false,
+            "Capture the active window, including its window manager "
+            "decorations");
+
+DEFINE_string(geometry, "",
+              "Region to capture, as an X geometry string (WxH+X+Y; negative "
+              "offsets are from the right and bottom edges), relative to the "
+              "captured window if one is chosen or to the screen otherwise");
+
+DEFINE_bool(freeze, false,
+            "With --region, capture the whole screen first and select the "
+            "region from a frozen copy of it");
+
+DEFINE_bool(trim, false,
+            "Crop away any margins that are the same color as the captured "
+            "region's top-left pixel before saving");
+
+DEFINE_string(palette, "auto",
+              "PNG color type: \"auto\" writes an indexed PNG if the image "
+              "has at most 256 colors, \"never\" always writes truecolor");
+
+DEFINE_string(png_speed, "default",
+              "PNG encoding speed: \"default\" compresses well, "
+              "\"fastest\" encodes several times faster into larger files "
+              "(and never writes indexed PNGs)");
+
+DEFINE_int32(auto_tune_ms, 0,
+             "If positive, try several PNG compression settings on part of "
+             "the image and use the one expected to give the smallest file "
+             "while encoding in at most this many milliseconds");
+
+DEFINE_string(output, "",
+              "Comma-separated list of files to write (in addition to "
+              "FILENAME); each file's extension selects its format: .png, "
+              ".jpg/.jpeg, or .raw (packed RGB or RGBA bytes)");
+
+DEFINE_int32(jpeg_quality, 90, "Quality of JPEG output, from 0 to 100");
+
+DEFINE_int32(frames, 1,
+             "Number of frames to capture; if greater than 1, an animated "
+             "PNG is written");
+
+DEFINE_int32(frame_interval_ms, 100,
+             "Delay between frames when capturing an animation, in "
+             "milliseconds");
+
+DEFINE_bool(delta_frames, false,
+            "When capturing an animation, write pixels that didn't change "
+            "since the previous frame as transparent, which usually "
+            "compresses much better (but forces an alpha channel)");
+
+DEFINE_int32(wait_stable, 0,
+             "If positive, wait until the captured region has been unchanged "
+             "for this many milliseconds before saving it");
+
+DEFINE_int32(wait_stable_timeout_ms, 10000,
+             "Longest time that --wait_stable waits before saving the region "
+             "anyway");
+
+DEFINE_bool(clipboard, false,
+            "Copy the image to the clipboard (as image/png) instead of "
+            "writing it to a file");
+
+DEFINE_string(compare, "",
+              "PNG file to compare the capture against; the exit status is 2 "
+              "if they differ");
+
+DEFINE_int32(compare_tolerance, 0,
+             "Largest difference in any channel for which --compare still "
+             "considers a pixel to match");
+
+DEFINE_int32(compare_max_mismatches, 0,
+             "Number of mismatched pixels that --compare tolerates");
+
+DEFINE_string(diff_output, "",
+              "PNG file to which --compare writes a mask of the mismatched "
+              "pixels (white on black)");
+
+DEFINE_string(tile_store, "",
+              "Directory holding the content-addressed tiles referenced by "
+              ".manifest output files");
+
+DEFINE_int32(tile_size, 64, "Width and height of tiles in .manifest output");
+
+DEFINE_string(reassemble, "",
+              "Instead of capturing the screen, rebuild the image described "
+              "by this tile manifest (see --tile_store) and write it to the "
+              "output files");
+
+DEFINE_int32(write_buffer_mb, 64,
+             "Maximum amount of encoded animation data that may be waiting "
+             "to be written to disk, in megabytes");
+
+DEFINE_bool(background, false,
+            "Return as soon as the image has been captured, leaving a child "
+            "process to encode and write it");
+
+DEFINE_bool(resident, false,
+            "Stay running and take screenshots when the --hotkey_* keys are "
+            "pressed.  Output filenames are strftime(3) patterns.");
+
+DEFINE_string(hotkey_screen, "Print",
+              "Key combination that captures the screen in --resident mode "
+              "(e.g. \"Ctrl+Shift+Print\"; empty to disable)");
+
+DEFINE_string(hotkey_window, "Alt+Print",
+              "Key combination that captures the active window (or the one "
+              "matching --window_name or --window_class) in --resident mode");
+
+DEFINE_string(hotkey_region, "Shift+Print",
+              "Key combination that captures a selected region in "
+              "--resident mode");
+
+DEFINE_bool(visual_feedback, true,
+            "Briefly flash the captured region after taking a screenshot");
+
+DEFINE_string(cpu_level, "",
+              "Instruction set used by the pixel kernels: \"baseline\", "
+              "\"avx2\", or \"avx512\" (if empty, the best one that this "
+              "CPU supports is used)");
+
+DEFINE_bool(huge_pages, false,
+            "Back shared-memory capture buffers with huge pages if available");
+
+using std::deque;
 using std::hex;
 using std::istringstream;
 using std::max;
 using std::min;
 using std::numeric_limits;
+using std::string;
+using std::thread;
+using std::vector;
 
 namespace {
 
 static const char* kUsage =
     "Usage: screenshot [FLAGS] FILENAME.png\n"
+    "       screenshot [FLAGS] --output=FILE1,FILE2,...\n"
+    "       screenshot [FLAGS] --clipboard\n"
+    "       screenshot [FLAGS] --resident PATTERN.png\n"
+    "       screenshot [FLAGS] --compare=EXPECTED.png [--diff_output=FILE]\n"
+    "       screenshot --tile_store=DIR --reassemble=FILE.manifest FILE.png\n"
     "\n"
-    "Saves the contents of the entire screen or of a window to a file.";
+    "Saves the contents of the entire screen or of a window to files or to\n"
+    "the clipboard.";
 
 // How opaque should the window that we flash onscreen to provide visual
 // feedback after the screenshot is taken be (assuming that there's a
@@ -52,38 +218,67 @@ static const double kVisualFeedbackWindowOpacity = 0.25;
 // How long should the visual feedback window be displayed?
 static const uint64_t kVisualFeedbackWindowDisplayTimeMs = 100;
 
+// Formats that images can be written in.
+enum OutputFormat {
+  OUTPUT_PNG,
+  OUTPUT_JPEG,
+  OUTPUT_RAW,  // packed 8-bit RGB (or RGBA) rows with no header
+  OUTPUT_TILES,  // manifest of tiles added to --tile_store
+};
+
+// Exit status used when --compare finds a difference.
+static const int kCompareFailedExitCode = 2;
+
+// How often --wait_stable samples the captured region.
+static const int kStablePollIntervalMs = 20;
+
+// Only every this-many rows are hashed when checking whether the captured
+// region has changed.  Almost anything that changes on screen (text,
+// widgets, animations) spans several rows.
+static const int kStableSampleRowStep = 4;
+
+// Maximum number of captured frames that may be waiting to be encoded while
+// recording an animation.  Capturing blocks once this many are queued.
+static const size_t kMaxQueuedFrames = 8;
+
+// Returns the current time in microseconds.
+uint64_t GetCurrentTimeUs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
 // Lets the user drag a box to select a region of the screen.
+//
+// The box is drawn by a single screen-sized override-redirect window whose
+// bounding region is shaped (using the X SHAPE extension) to just the box's
+// border, so each update during a drag only needs to reshape the window and
+// paint the border's interior line.
 class RegionSelector {
  public:
   explicit RegionSelector(Display* display)
       : display_(display),
         root_(DefaultRootWindow(display_)),
         cursor_(XCreateFontCursor(display_, XC_cross)),
-        left_win_(CreateWindow()),
-        right_win_(CreateWindow()),
-        top_win_(CreateWindow()),
-        bottom_win_(CreateWindow()) {
-    XGCValues values;
-    values.fill_style = FillSolid;
-    const unsigned long value_mask = GCForeground | GCBackground | GCFillStyle;
+        win_(None),
+        num_updates_(0),
+        num_update_requests_(0),
+        total_update_time_us_(0),
+        max_update_time_us_(0) {
+    int shape_event_base = 0, shape_error_base = 0;
+    CHECK(XShapeQueryExtension(display_, &shape_event_base, &shape_error_base))
+        << "X server doesn't support the SHAPE extension";
+    win_ = CreateWindow();
 
-    values.foreground = values.background =
-        BlackPixel(display_, DefaultScreen(display_));
-    black_gc_ = XCreateGC(display_, root_, value_mask, &values);
-
-    values.foreground = values.background =
-        WhitePixel(display_, DefaultScreen(display_));
-    white_gc_ = XCreateGC(display_, root_, value_mask, &values);
+    white_gc_ = CreateSolidGC(WhitePixel(display_, DefaultScreen(display_)));
+    black_gc_ = CreateSolidGC(BlackPixel(display_, DefaultScreen(display_)));
   }
 
   ~RegionSelector() {
-    XDestroyWindow(display_, left_win_);
-    XDestroyWindow(display_, right_win_);
-    XDestroyWindow(display_, top_win_);
-    XDestroyWindow(display_, bottom_win_);
+    XDestroyWindow(display_, win_);
     XFreeCursor(display_, cursor_);
-    XFreeGC(display_, black_gc_);
     XFreeGC(display_, white_gc_);
+    XFreeGC(display_, black_gc_);
   }
 
   // Returns false on failure (e.g. couldn't grab, user aborted, etc.).
@@ -104,15 +299,37 @@ class RegionSelector {
       usleep(kKeyboardGrabDelayMs * 1000);
     }
 
-    MoveWindowsOffscreen();
-    XMapWindow(display_, left_win_);
-    XMapWindow(display_, right_win_);
-    XMapWindow(display_, top_win_);
-    XMapWindow(display_, bottom_win_);
+    HideBorder();
+    XMapWindow(display_, win_);
+
+    num_updates_ = 0;
+    num_update_requests_ = 0;
+    total_update_time_us_ = 0;
+    max_update_time_us_ = 0;
 
     bool done = false, dragging = false, aborted = false;
     int start_x = 0, start_y = 0, end_x = 0, end_y = 0;
+
+    // Motion events just record the pointer position; the border is updated
+    // at most once per kMinUpdateIntervalUs, and only once all queued events
+    // have been handled.
+    bool update_pending = false;
+    uint64_t last_update_time_us = 0;
+
     while (!done && !aborted) {
+      if (update_pending && XPending(display_) == 0) {
+        const uint64_t next_update_time_us =
+            last_update_time_us + kMinUpdateIntervalUs;
+        const uint64_t now_us = GetCurrentTimeUs();
+        if (now_us >= next_update_time_us ||
+            !WaitForEvent(next_update_time_us - now_us)) {
+          UpdateBorder(start_x, start_y, end_x, end_y);
+          update_pending = false;
+          last_update_time_us = GetCurrentTimeUs();
+          continue;
+        }
+      }
+
       XEvent event;
       XNextEvent(display_, &event);
       switch (event.type) {
@@ -128,15 +345,13 @@ class RegionSelector {
             done = true;
           }
           break;
-        case Expose:
-          PaintWindow(event.xexpose.window, start_x, start_y, end_x, end_y);
-          break;
         case KeyPress:
           if (event.xkey.keycode == XKeysymToKeycode(display_, XK_Escape)) {
             // If we're in a drag, cancel it; otherwise, abort the selection.
             if (dragging) {
               dragging = false;
-              MoveWindowsOffscreen();
+              update_pending = false;
+              HideBorder();
             } else {
               aborted = true;
             }
@@ -144,9 +359,18 @@ class RegionSelector {
           break;
         case MotionNotify:
           if (dragging) {
+            // Skip over any other motion events that are already queued
+            // behind this one; only the most recent position matters.
+            XEvent next_event;
+            while (XEventsQueued(display_, QueuedAfterReading) > 0) {
+              XPeekEvent(display_, &next_event);
+              if (next_event.type != MotionNotify)
+                break;
+              XNextEvent(display_, &event);
+            }
             end_x = event.xmotion.x_root;
             end_y = event.xmotion.y_root;
-            ConfigureWindows(start_x, start_y, end_x, end_y);
+            update_pending = true;
           }
           break;
       }
@@ -154,10 +378,15 @@ class RegionSelector {
 
     XUngrabKeyboard(display_, CurrentTime);
     XUngrabPointer(display_, CurrentTime);
-    XUnmapWindow(display_, left_win_);
-    XUnmapWindow(display_, right_win_);
-    XUnmapWindow(display_, top_win_);
-    XUnmapWindow(display_, bottom_win_);
+    XUnmapWindow(display_, win_);
+
+    if (num_updates_ > 0) {
+      VLOG(1) << "Updated selection " << num_updates_ << " time(s) using "
+              << static_cast<double>(num_update_requests_) / num_updates_
+              << " request(s) each; mean latency "
+              << total_update_time_us_ / num_updates_ << " us, max "
+              << max_update_time_us_ << " us";
+    }
 
     if (aborted)
       return false;
@@ -166,7 +395,7 @@ class RegionSelector {
     *y = min(start_y, end_y);
     *width = static_cast<unsigned int>(max(start_x, end_x) - *x);
     *height = static_cast<unsigned int>(max(start_y, end_y) - *y);
-    return (width > 0 && height > 0);
+    return (*width > 0 && *height > 0);
   }
 
  private:
@@ -182,96 +411,128 @@ class RegionSelector {
   // Delay before we retry grabbing the keyboard, in milliseconds.
   static const int kKeyboardGrabDelayMs = 100;
 
-  // Create and return an offscreen border window.  Doesn't map it.
+  // Minimum time between border updates during a drag, in microseconds.
+  // This matches a 60 Hz display; updating faster than the screen refreshes
+  // just queues up work for the X server.
+  static const uint64_t kMinUpdateIntervalUs = 1000000 / 60;
+
+  // Wait up to |timeout_us| microseconds for an event to arrive from the X
+  // server, returning true if one is available.
+  bool WaitForEvent(uint64_t timeout_us) {
+    const int fd = ConnectionNumber(display_);
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    struct timeval timeout;
+    timeout.tv_sec = timeout_us / 1000000;
+    timeout.tv_usec = timeout_us % 1000000;
+    return select(fd + 1, &fds, NULL, NULL, &timeout) > 0;
+  }
+
+  // Create and return a GC that fills with |pixel|.
+  GC CreateSolidGC(unsigned long pixel) {
+    XGCValues values;
+    values.fill_style = FillSolid;
+    values.foreground = values.background = pixel;
+    return XCreateGC(display_, root_,
+                     GCForeground | GCBackground | GCFillStyle, &values);
+  }
+
+  // Create and return a screen-sized border window with an empty shape.
+  // Doesn't map it.
   Window CreateWindow() {
+    const int screen = DefaultScreen(display_);
     XSetWindowAttributes attr;
-    attr.background_pixel = BlackPixel(display_, DefaultScreen(display_));
+    attr.background_pixel = BlackPixel(display_, screen);
     attr.override_redirect = True;
     Window win = XCreateWindow(display_,
                                root_,           // parent
-                               -1, -1, 1, 1,    // geometry
+                               0, 0,            // x, y
+                               DisplayWidth(display_, screen),
+                               DisplayHeight(display_, screen),
                                0,               // border_width
                                CopyFromParent,  // depth
                                InputOutput,     // class
                                NULL,            // visual
                                CWBackPixel | CWOverrideRedirect,
                                &attr);
-    XSelectInput(display_, win, ExposureMask);
+    XShapeCombineRectangles(display_, win, ShapeBounding,
+                            0, 0,  // x_off, y_off
+                            NULL, 0, ShapeSet, YXBanded);
     return win;
   }
 
-  // Configure all of the border windows to frame the current dragged region.
-  void ConfigureWindows(int start_x, int start_y, int drag_x, int drag_y) {
+  // Get rectangles covering a border of width |border| around the region
+  // bounded by |left|, |top|, |right|, and |bottom|.
+  static void GetBorderRects(int left, int top, int right, int bottom,
+                             int border, XRectangle* rects) {
+    const int width = right - left;
+    const int height = bottom - top;
+    const XRectangle border_rects[4] = {
+      // top
+      { static_cast<short>(left - border), static_cast<short>(top - border),
+        static_cast<unsigned short>(width + 2 * border),
+        static_cast<unsigned short>(border) },
+      // left
+      { static_cast<short>(left - border), static_cast<short>(top),
+        static_cast<unsigned short>(border),
+        static_cast<unsigned short>(height) },
+      // right
+      { static_cast<short>(right), static_cast<short>(top),
+        static_cast<unsigned short>(border),
+        static_cast<unsigned short>(height) },
+      // bottom
+      { static_cast<short>(left - border), static_cast<short>(bottom),
+        static_cast<unsigned short>(width + 2 * border),
+        static_cast<unsigned short>(border) },
+    };
+    std::copy(border_rects, border_rects + 4, rects);
+  }
+
+  // Reshape the border window to frame the current dragged region and paint
+  // the border's interior.
+  void UpdateBorder(int start_x, int start_y, int drag_x, int drag_y) {
+    const uint64_t start_time_us = GetCurrentTimeUs();
+    const unsigned long start_request = NextRequest(display_);
+
     const int left = min(drag_x, start_x);
     const int right = max(drag_x, start_x);
     const int top = min(drag_y, start_y);
     const int bottom = max(drag_y, start_y);
 
-    XMoveResizeWindow(display_, left_win_,
-                      left - kBorder, top,
-                      kBorder, max(bottom - top, 1));
-    XMoveResizeWindow(display_, right_win_,
-                      right, top,
-                      kBorder, max(bottom - top, 1));
-    XMoveResizeWindow(display_, top_win_,
-                      left - kBorder, top - kBorder,
-                      right - left + 2 * kBorder, kBorder);
-    XMoveResizeWindow(display_, bottom_win_,
-                      left - kBorder, bottom,
-                      right - left + 2 * kBorder, kBorder);
-  }
-
-  // Move all of the border windows offscreen.
-  void MoveWindowsOffscreen() {
-    XMoveResizeWindow(display_, left_win_, -1, -1, 1, 1);
-    XMoveResizeWindow(display_, right_win_, -1, -1, 1, 1);
-    XMoveResizeWindow(display_, top_win_, -1, -1, 1, 1);
-    XMoveResizeWindow(display_, bottom_win_, -1, -1, 1, 1);
-  }
-
-  // Repaint a border window.
-  void PaintWindow(Window win,
-                   int start_x, int start_y,
-                   int drag_x, int drag_y) {
-    const int width = max(start_x, drag_x) - min(start_x, drag_x);
-    const int height = max(start_y, drag_y) - min(start_y, drag_y);
-
-    if (win == left_win_) {
-      XFillRectangle(display_, win, black_gc_,
-                     0, 0, kBorder - kInteriorBorder, height);
-      XFillRectangle(display_, win, white_gc_,
-                     kBorder - kInteriorBorder, 0, kInteriorBorder, height);
-    } else if (win == right_win_) {
-      XFillRectangle(display_, win, black_gc_,
-                     kInteriorBorder, 0, kBorder - kInteriorBorder, height);
-      XFillRectangle(display_, win, white_gc_,
-                     0, 0, kInteriorBorder, height);
-    } else if (win == top_win_) {
-      XFillRectangle(display_, win, black_gc_,
-                     0, 0, width + 2 * kBorder, kBorder - kInteriorBorder);
-      XFillRectangle(display_, win, black_gc_,
-                     0, kBorder - kInteriorBorder,
-                     kBorder - kInteriorBorder, kInteriorBorder);
-      XFillRectangle(display_, win, black_gc_,
-                     kBorder + width + kInteriorBorder,
-                     kBorder - kInteriorBorder,
-                     kBorder - kInteriorBorder, kInteriorBorder);
-      XFillRectangle(display_, win, white_gc_,
-                     kBorder - kInteriorBorder, kBorder - kInteriorBorder,
-                     width + 2 * kInteriorBorder, kInteriorBorder);
-    } else if (win == bottom_win_) {
-      XFillRectangle(display_, win, black_gc_,
-                     0, kInteriorBorder,
-                     width + 2 * kBorder, kBorder - kInteriorBorder);
-      XFillRectangle(display_, win, black_gc_,
-                     0, 0, kBorder - kInteriorBorder, kInteriorBorder);
-      XFillRectangle(display_, win, black_gc_,
-                     kBorder + width + kInteriorBorder, 0,
-                     kBorder - kInteriorBorder, kInteriorBorder);
-      XFillRectangle(display_, win, white_gc_,
-                     kBorder - kInteriorBorder, 0,
-                     width + 2 * kInteriorBorder, kInteriorBorder);
-    }
+    // Reshaping doesn't repaint pixels that were already inside the old
+    // shape, so pixels that were part of the interior line before the
+    // selection shrank would stay white.  Paint the whole border black and
+    // then draw the interior line over it.
+    XRectangle rects[4];
+    GetBorderRects(left, top, right, bottom, kBorder, rects);
+    XShapeCombineRectangles(display_, win_, ShapeBounding,
+                            0, 0,  // x_off, y_off
+                            rects, 4, ShapeSet, Unsorted);
+    XFillRectangles(display_, win_, black_gc_, rects, 4);
+    GetBorderRects(left, top, right, bottom, kInteriorBorder, rects);
+    XFillRectangles(display_, win_, white_gc_, rects, 4);
+
+    // Only wait for the server to handle the requests when the timing will
+    // be logged; otherwise we'd just be measuring how long it takes to
+    // buffer them.
+    if (VLOG_IS_ON(1))
+      XSync(display_, False);
+    else
+      XFlush(display_);
+
+    const uint64_t elapsed_us = GetCurrentTimeUs() - start_time_us;
+    num_updates_++;
+    num_update_requests_ += NextRequest(display_) - start_request;
+    total_update_time_us_ += elapsed_us;
+    max_update_time_us_ = max(max_update_time_us_, elapsed_us);
+  }
+
+  // Hide the border by giving the window an empty shape.
+  void HideBorder() {
+    XShapeCombineRectangles(display_, win_, ShapeBounding,
+                            0, 0,  // x_off, y_off
+                            NULL, 0, ShapeSet, YXBanded);
   }
 
   // Grab the pointer, returning true if successful.
@@ -304,8 +565,15 @@ class RegionSelector {
   Display* display_;
   Window root_;
   Cursor cursor_;
-  Window left_win_, right_win_, top_win_, bottom_win_;
-  GC black_gc_, white_gc_;
+  Window win_;
+  GC white_gc_;
+  GC black_gc_;
+
+  // Statistics about UpdateBorder() calls, logged after each selection.
+  int num_updates_;
+  uint64_t num_update_requests_;
+  uint64_t total_update_time_us_;
+  uint64_t max_update_time_us_;
 };
 
 
@@ -341,29 +609,1172 @@ Window CreateVisualFeedbackWindow(Display* display,
   return win;
 }
 
+// Briefly display a visual feedback window over the given region.
+void FlashVisualFeedback(Display* display,
+                         int x, int y,
+                         unsigned int width, unsigned int height) {
+  Window visual_feedback_win =
+      CreateVisualFeedbackWindow(display, x, y, width, height);
+  XMapWindow(display, visual_feedback_win);
+  XFlush(display);
+
+  usleep(kVisualFeedbackWindowDisplayTimeMs * 1000);
+  XDestroyWindow(display, visual_feedback_win);
+  XFlush(display);
+}
+
+// Fetch the given region of |win| from the X server using |pool|.  Returns
+// NULL (after logging why) on failure.  The image should be passed to
+// CapturePool::Release().
+XImage* TryCaptureImage(screenshot::CapturePool* pool, Window win,
+                        int x, int y,
+                        unsigned int width, unsigned int height) {
+  XImage* image = pool->Capture(win, x, y, width, height);
+  if (!image) {
+    LOG(ERROR) << "Unable to capture " << width << "x" << height << " at ("
+               << x << ", " << y << ") in window 0x" << hex << win << std::dec;
+    return NULL;
+  }
+  if ((image->depth != 24 && image->depth != 32) ||
+      image->bits_per_pixel != 32) {
+    LOG(ERROR) << "Unsupported image depth " << image->depth << " or bits "
+               << "per pixel " << image->bits_per_pixel;
+    pool->Release(image);
+    return NULL;
+  }
+  return image;
+}
+
+// Like TryCaptureImage(), but crashes on failure.
+XImage* CaptureImage(screenshot::CapturePool* pool, Window win,
+                     int x, int y, unsigned int width, unsigned int height) {
+  XImage* image = TryCaptureImage(pool, win, x, y, width, height);
+  CHECK(image);
+  return image;
+}
+
+// Return a view of |image|'s pixels.  32-bit-deep images normally carry
+// premultiplied alpha, but if |force_opaque| is true the alpha channel is
+// ignored.  That's needed for the root window: even with a 32-bit visual,
+// the screen is opaque and its alpha bytes are meaningless.
+screenshot::Image GetPixels(const XImage* image, bool force_opaque) {
+  screenshot::Image pixels;
+  pixels.data = reinterpret_cast<unsigned char*>(image->data);
+  pixels.width = image->width;
+  pixels.height = image->height;
+  pixels.stride = image->bytes_per_line;
+  pixels.has_alpha = image->depth == 32 && !force_opaque;
+  return pixels;
+}
+
+// Returns a hash of every kStableSampleRowStep-th row of |pixels|.
+uint64_t HashSampledRows(const screenshot::Image& pixels) {
+  const uint32_t alpha_mask = pixels.has_alpha ? 0 : 0xff000000;
+  uint64_t hash = 14695981039346656037ULL;  // FNV-1a offset basis
+  for (int y = 0; y < pixels.height; y += kStableSampleRowStep) {
+    const uint32_t* row = pixels.Row(y);
+    for (int x = 0; x < pixels.width; ++x) {
+      hash ^= row[x] | alpha_mask;
+      hash *= 1099511628211ULL;  // FNV prime
+    }
+  }
+  return hash;
+}
+
+// Capture the given region of |win| once its contents have been unchanged
+// for |stable_ms| milliseconds, sampling it every kStablePollIntervalMs.
+// If it's still changing after |timeout_ms|, the latest capture is returned
+// anyway.  The returned image is the last sample, so no extra capture is
+// needed once the region settles.
+XImage* CaptureStableImage(screenshot::CapturePool* pool, Window win,
+                           int x, int y,
+                           unsigned int width, unsigned int height,
+                           int stable_ms, int timeout_ms) {
+  const uint64_t start_ms = GetCurrentTimeUs() / 1000;
+  XImage* image = CaptureImage(pool, win, x, y, width, height);
+  // Any alpha channel is included in the hash, which is harmless for
+  // comparing samples with each other.
+  uint64_t hash = HashSampledRows(GetPixels(image, false));
+  uint64_t stable_since_ms = start_ms;
+  int num_samples = 1;
+  while (true) {
+    const uint64_t now_ms = GetCurrentTimeUs() / 1000;
+    if (now_ms - stable_since_ms >= static_cast<uint64_t>(stable_ms))
+      break;
+    if (now_ms - start_ms >= static_cast<uint64_t>(timeout_ms)) {
+      LOG(WARNING) << "Region still changing after " << timeout_ms << " ms; "
+                   << "capturing it anyway";
+      break;
+    }
+
+    usleep(kStablePollIntervalMs * 1000);
+    // Release the previous sample first so that the pool can reuse it.
+    pool->Release(image);
+    image = CaptureImage(pool, win, x, y, width, height);
+    num_samples++;
+    const uint64_t new_hash = HashSampledRows(GetPixels(image, false));
+    if (new_hash != hash) {
+      hash = new_hash;
+      stable_since_ms = GetCurrentTimeUs() / 1000;
+    }
+  }
+  VLOG(1) << "Region was stable after " << GetCurrentTimeUs() / 1000 - start_ms
+          << " ms and " << num_samples << " sample(s)";
+  return image;
+}
+
+// Encodes captured frames into an animated PNG file on a separate thread,
+// so that capturing can continue at a steady rate while earlier frames are
+// compressed and written.
+class AnimationWriter {
+ public:
+  AnimationWriter(screenshot::AsyncFileWriter* output,
+                  int num_frames, int delay_ms,
+                  const screenshot::PngOptions& options,
+                  screenshot::CapturePool* pool,
+                  bool force_opaque)
+      : output_(output),
+        pool_(pool),
+        force_opaque_(force_opaque),
+        num_frames_(num_frames),
+        delay_ms_(delay_ms),
+        encoder_(num_frames, options, FLAGS_delta_frames),
+        thread_(&AnimationWriter::Run, this) {
+  }
+
+  ~AnimationWriter() {
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  // Queue |image| to be encoded and then returned to the pool.  Blocks while
+  // too many earlier frames are still waiting.
+  void AddFrame(XImage* image) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (queue_.size() >= kMaxQueuedFrames)
+      LOG(WARNING) << "Encoder is falling behind; delaying capture";
+    cond_.wait(lock, [this] { return queue_.size() < kMaxQueuedFrames; });
+    queue_.push_back(image);
+    cond_.notify_all();
+  }
+
+  // Wait for all |num_frames| frames to be written, returning false if
+  // writing failed.
+  bool Finish() {
+    thread_.join();
+    return output_->Finish();
+  }
+
+ private:
+  void Run() {
+    XImage* previous = NULL;
+    screenshot::Image previous_pixels;
+    string out;
+    uint64_t encode_time_us = 0;
+    uint64_t raw_bytes = 0, encoded_bytes = 0;
+    for (int i = 0; i < num_frames_; ++i) {
+      XImage* image = NULL;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return !queue_.empty(); });
+        image = queue_.front();
+        queue_.pop_front();
+        cond_.notify_all();
+      }
+
+      const screenshot::Image pixels = GetPixels(image, force_opaque_);
+      const uint64_t start_time_us = GetCurrentTimeUs();
+      encoder_.AddFrame(pixels, previous ? &previous_pixels : NULL,
+                        delay_ms_, &out);
+      if (i == num_frames_ - 1)
+        encoder_.Finish(&out);
+      encode_time_us += GetCurrentTimeUs() - start_time_us;
+      raw_bytes += static_cast<uint64_t>(pixels.width) * pixels.height *
+                   (pixels.has_alpha ? 4 : 3);
+      encoded_bytes += out.size();
+      output_->Write(&out);
+
+      if (previous)
+        pool_->Release(previous);
+      previous = image;
+      previous_pixels = pixels;
+    }
+    if (previous)
+      pool_->Release(previous);
+    VLOG(1) << "Encoded " << num_frames_ << " frames in " << encode_time_us
+            << " us (" << raw_bytes / max<uint64_t>(encode_time_us, 1)
+            << " MB/s) to " << encoded_bytes << " bytes ("
+            << static_cast<double>(raw_bytes) / max<uint64_t>(encoded_bytes, 1)
+            << ":1)";
+  }
+
+  screenshot::AsyncFileWriter* output_;  // not owned
+  screenshot::CapturePool* pool_;  // not owned
+  const bool force_opaque_;  // passed to GetPixels()
+  const int num_frames_;
+  const int delay_ms_;
+  screenshot::AnimatedPngEncoder encoder_;
+
+  // Frames that have been captured but not yet encoded.
+  deque<XImage*> queue_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+
+  // Declared last so that it starts after everything else is initialized.
+  thread thread_;
+};
+
+// Capture |FLAGS_frames| images of the given region of |win| and write them
+// to |filename| as an animated PNG.  |force_opaque| is passed to
+// GetPixels().  Returns false on failure.
+bool RecordAnimation(screenshot::CapturePool* pool, Window win,
+                     int x, int y, unsigned int width, unsigned int height,
+                     bool force_opaque, const char* filename,
+                     const screenshot::PngOptions& options) {
+  const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return false;
+
+  screenshot::AsyncFileWriter* output = screenshot::AsyncFileWriter::Create(
+      fd, static_cast<size_t>(FLAGS_write_buffer_mb) * 1024 * 1024);
+  AnimationWriter writer(output, FLAGS_frames, FLAGS_frame_interval_ms,
+                         options, pool, force_opaque);
+  uint64_t next_capture_ms = GetCurrentTimeUs() / 1000;
+  for (int i = 0; i < FLAGS_frames; ++i) {
+    const uint64_t now_ms = GetCurrentTimeUs() / 1000;
+    if (now_ms < next_capture_ms)
+      usleep((next_capture_ms - now_ms) * 1000);
+    next_capture_ms += FLAGS_frame_interval_ms;
+    writer.AddFrame(CaptureImage(pool, win, x, y, width, height));
+  }
+
+  const bool success = writer.Finish();
+  VLOG(1) << "Capture pool had " << pool->num_hits() << " hit(s) and "
+          << pool->num_misses() << " miss(es)";
+
+  const screenshot::AsyncWriteStats& stats = output->stats();
+  if (stats.num_writes > 0) {
+    VLOG(1) << "Performed " << stats.num_writes << " write(s) with mean queue "
+            << "depth " << static_cast<double>(stats.total_queue_depth) /
+                           stats.num_writes
+            << " (max " << stats.max_queue_depth << ") and mean latency "
+            << stats.total_latency_us / stats.num_writes << " us (max "
+            << stats.max_latency_us << " us)";
+  }
+  delete output;
+  return close(fd) == 0 && success;
+}
+
+// Create and return a screen-sized window displaying |image|, which should
+// hold the contents of the entire screen, so that a region can be selected
+// from a frozen copy of the screen.  Doesn't map the window.
+Window CreateFrozenScreenWindow(Display* display, XImage* image) {
+  Window root = DefaultRootWindow(display);
+  Pixmap pixmap = XCreatePixmap(display, root,
+                                image->width, image->height, image->depth);
+  GC gc = XCreateGC(display, pixmap, 0, NULL);
+  XPutImage(display, pixmap, gc, image,
+            0, 0,  // src_x, src_y
+            0, 0,  // dest_x, dest_y
+            image->width, image->height);
+  XFreeGC(display, gc);
+
+  // The server paints the window from its background pixmap, so we don't
+  // need to handle Expose events.
+  XSetWindowAttributes attr;
+  attr.background_pixmap = pixmap;
+  attr.override_redirect = True;
+  Window win = XCreateWindow(display,
+                             root,
+                             0, 0, image->width, image->height,
+                             0,               // border_width
+                             CopyFromParent,  // depth
+                             InputOutput,     // class
+                             NULL,            // visual
+                             CWBackPixmap | CWOverrideRedirect,
+                             &attr);
+  XFreePixmap(display, pixmap);
+  return win;
+}
+
+// Write |size| bytes from |data| to the file at |filename|, returning false
+// on failure.
+bool WriteFile(const char* filename, const char* data, size_t size) {
+  FILE* file = fopen(filename, "wb");
+  if (!file)
+    return false;
+  const bool success = fwrite(data, 1, size, file) == size;
+  return fclose(file) == 0 && success;
+}
+
+// Read the file at |filename| into |contents|, returning false on failure.
+bool ReadFile(const char* filename, string* contents) {
+  FILE* file = fopen(filename, "rb");
+  if (!file)
+    return false;
+  contents->clear();
+  char buffer[4096];
+  size_t bytes_read = 0;
+  while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    contents->append(buffer, bytes_read);
+  const bool success = !ferror(file);
+  fclose(file);
+  return success;
+}
+
+// Read the first |num_values| 32-bit values of |property| on |win| into
+// |values|.  Returns false if the property isn't set or is too short.
+bool GetLongProperty(Display* display, Window win, const char* property,
+                     int num_values, long* values) {
+  Atom type = None;
+  int format = 0;
+  unsigned long num_items = 0, bytes_after = 0;
+  unsigned char* data = NULL;
+  if (XGetWindowProperty(display, win, XInternAtom(display, property, False),
+                         0, num_values,  // offset, length
+                         False,          // delete
+                         AnyPropertyType,
+                         &type, &format, &num_items, &bytes_after,
+                         &data) != Success) {
+    return false;
+  }
+  const bool success = data && format == 32 &&
+                       num_items >= static_cast<unsigned long>(num_values);
+  if (success) {
+    // Xlib returns 32-bit values as longs.
+    const long* items = reinterpret_cast<const long*>(data);
+    std::copy(items, items + num_values, values);
+  }
+  if (data)
+    XFree(data);
+  return success;
+}
+
+// Returns the child of the root window that contains |win|, which is the
+// frame window if the window manager reparents clients, or None on error.
+Window GetTopLevelWindow(Display* display, Window win) {
+  const Window root = DefaultRootWindow(display);
+  while (true) {
+    Window root_ret = None, parent = None;
+    Window* children = NULL;
+    unsigned int num_children = 0;
+    if (!XQueryTree(display, win, &root_ret, &parent,
+                    &children, &num_children)) {
+      return None;
+    }
+    if (children)
+      XFree(children);
+    if (parent == root || parent == None)
+      return win;
+    win = parent;
+  }
+}
+
+// Find the window manager's active window and the rectangle covering it and
+// its decorations, as described by _NET_FRAME_EXTENTS.  |win| is set to the
+// window to capture from: the top-level frame window if the rectangle lies
+// within it (so the capture isn't affected by overlapping windows under a
+// compositing manager), or the root window otherwise.  Returns false if
+// there's no active window.
+bool GetActiveWindowRect(Display* display, Window* win,
+                         int* x, int* y,
+                         unsigned int* width, unsigned int* height) {
+  const Window root = DefaultRootWindow(display);
+  long active = None;
+  if (!GetLongProperty(display, root, "_NET_ACTIVE_WINDOW", 1, &active) ||
+      active == None) {
+    return false;
+  }
+  const Window client = active;
+  const Window frame = GetTopLevelWindow(display, client);
+  if (frame == None)
+    return false;
+
+  // Extents that the window manager doesn't report are left at zero.
+  long extents[4] = { 0, 0, 0, 0 };  // left, right, top, bottom
+  GetLongProperty(display, client, "_NET_FRAME_EXTENTS", 4, extents);
+
+  Window root_ret = None, child_ret = None;
+  int client_x = 0, client_y = 0;
+  unsigned int client_width = 0, client_height = 0;
+  unsigned int border_width = 0, depth = 0;
+  if (!XGetGeometry(display, client, &root_ret, &client_x, &client_y,
+                    &client_width, &client_height, &border_width, &depth) ||
+      !XTranslateCoordinates(display, client, root, 0, 0,
+                             &client_x, &client_y, &child_ret)) {
+    return false;
+  }
+  int left = client_x - extents[0];
+  int top = client_y - extents[2];
+  int right = client_x + static_cast<int>(client_width) + extents[1];
+  int bottom = client_y + static_cast<int>(client_height) + extents[3];
+
+  int frame_x = 0, frame_y = 0;
+  unsigned int frame_width = 0, frame_height = 0;
+  if (!XGetGeometry(display, frame, &root_ret, &frame_x, &frame_y,
+                    &frame_width, &frame_height, &border_width, &depth)) {
+    return false;
+  }
+  // The frame's position is that of its border's outer corner.
+  frame_x += border_width;
+  frame_y += border_width;
+  if (left >= frame_x && top >= frame_y &&
+      right <= frame_x + static_cast<int>(frame_width) &&
+      bottom <= frame_y + static_cast<int>(frame_height)) {
+    *win = frame;
+    left -= frame_x;
+    right -= frame_x;
+    top -= frame_y;
+    bottom -= frame_y;
+  } else {
+    // Decorations drawn outside of the frame (or by a non-reparenting
+    // window manager) can only be captured from the root window, where
+    // parts of the window may be off-screen.
+    *win = root;
+    left = max(left, 0);
+    top = max(top, 0);
+    right = min(right, DisplayWidth(display, DefaultScreen(display)));
+    bottom = min(bottom, DisplayHeight(display, DefaultScreen(display)));
+    if (right <= left || bottom <= top)
+      return false;
+  }
+
+  *x = left;
+  *y = top;
+  *width = right - left;
+  *height = bottom - top;
+  VLOG(1) << "Active window 0x" << hex << client << " has frame extents "
+          << extents[0] << "," << extents[1] << "," << extents[2] << ","
+          << extents[3] << "; capturing " << *width << "x" << *height
+          << " from 0x" << *win << std::dec;
+  return true;
+}
+
+// Update the |width|x|height| region at (|x|, |y|), which initially covers an
+// entire drawable, to the part of it described by |geometry| (a standard X
+// geometry string).  Omitted dimensions extend to the drawable's edges.
+// Returns false if |geometry| can't be parsed or doesn't intersect the
+// drawable.
+bool ApplyGeometry(const string& geometry,
+                   int* x, int* y, unsigned int* width, unsigned int* height) {
+  int geom_x = 0, geom_y = 0;
+  unsigned int geom_width = 0, geom_height = 0;
+  const int mask = XParseGeometry(geometry.c_str(),
+                                  &geom_x, &geom_y,
+                                  &geom_width, &geom_height);
+  if (mask == NoValue)
+    return false;
+
+  const int drawable_width = *width, drawable_height = *height;
+  if (!(mask & XValue))
+    geom_x = 0;
+  else if (mask & XNegative)
+    geom_x += drawable_width - (mask & WidthValue ? geom_width : 0);
+  if (!(mask & YValue))
+    geom_y = 0;
+  else if (mask & YNegative)
+    geom_y += drawable_height - (mask & HeightValue ? geom_height : 0);
+
+  int right = mask & WidthValue ? geom_x + static_cast<int>(geom_width) :
+                                  drawable_width;
+  int bottom = mask & HeightValue ? geom_y + static_cast<int>(geom_height) :
+                                    drawable_height;
+  const int left = max(geom_x, 0);
+  const int top = max(geom_y, 0);
+  right = min(right, drawable_width);
+  bottom = min(bottom, drawable_height);
+  if (right <= left || bottom <= top)
+    return false;
+
+  *x = left;
+  *y = top;
+  *width = right - left;
+  *height = bottom - top;
+  return true;
+}
+
+// Return the format to use for |filename|, based on its extension.
+OutputFormat GetOutputFormat(const string& filename) {
+  const size_t dot = filename.rfind('.');
+  string extension = dot == string::npos ? "" : filename.substr(dot + 1);
+  for (size_t i = 0; i < extension.size(); ++i)
+    extension[i] = tolower(extension[i]);
+
+  if (extension == "png")
+    return OUTPUT_PNG;
+  if (extension == "jpg" || extension == "jpeg")
+    return OUTPUT_JPEG;
+  if (extension == "raw")
+    return OUTPUT_RAW;
+  if (extension == "manifest")
+    return OUTPUT_TILES;
+  LOG(FATAL) << "Unknown output format for \"" << filename << "\" "
+             << "(should end in .png, .jpg, .jpeg, .raw or .manifest)";
+  return OUTPUT_PNG;
+}
+
+// Encode |image| in the format for |filename| and write it there.  Returns
+// false (after logging why) on failure.
+bool WriteOutput(const screenshot::RgbImage& image,
+                 const string& filename,
+                 const screenshot::PngOptions& png_options) {
+  const uint64_t start_time_us = GetCurrentTimeUs();
+  string encoded;
+  const char* data = NULL;
+  size_t size = 0;
+  switch (GetOutputFormat(filename)) {
+    case OUTPUT_PNG:
+      if (!screenshot::EncodePng(image, png_options, &encoded)) {
+        LOG(ERROR) << "Unable to encode image as PNG";
+        return false;
+      }
+      break;
+    case OUTPUT_JPEG:
+      if (!screenshot::EncodeJpeg(image, FLAGS_jpeg_quality, &encoded)) {
+        LOG(ERROR) << "Unable to encode image as JPEG";
+        return false;
+      }
+      break;
+    case OUTPUT_RAW:
+      data = reinterpret_cast<const char*>(&image.data[0]);
+      size = image.data.size();
+      break;
+    case OUTPUT_TILES:
+      LOG(FATAL) << "Tile manifests are written from unconverted pixels";
+      break;
+  }
+  if (!data) {
+    data = encoded.data();
+    size = encoded.size();
+  }
+  VLOG(1) << "Encoded " << filename << " in "
+          << GetCurrentTimeUs() - start_time_us << " us";
+  if (!WriteFile(filename.c_str(), data, size)) {
+    LOG(ERROR) << "Unable to write " << filename;
+    return false;
+  }
+  return true;
+}
+
+// Add |pixels| to the --tile_store directory and write its manifest to
+// |filename|.  Returns false (after logging why) on failure.
+bool WriteTileManifest(const screenshot::Image& pixels,
+                       const string& filename,
+                       const screenshot::PngOptions& png_options) {
+  screenshot::TileStore store(FLAGS_tile_store, png_options.compression_level);
+  string manifest;
+  if (!store.AddImage(pixels, FLAGS_tile_size, &manifest)) {
+    LOG(ERROR) << "Unable to add tiles to " << FLAGS_tile_store;
+    return false;
+  }
+  if (!WriteFile(filename.c_str(), manifest.data(), manifest.size())) {
+    LOG(ERROR) << "Unable to write " << filename;
+    return false;
+  }
+  VLOG(1) << "Wrote " << store.num_tiles_written() << " new tile(s) and "
+          << "reused " << store.num_tiles_reused() << " for " << filename;
+  return true;
+}
+
+// Write |pixels| to each of |filenames|.  The pixels are converted once into
+// |image|, and each file is then encoded and written on its own thread.
+// Passing the same |image| for each capture reuses its buffer.  Returns
+// false if any file couldn't be written.
+bool WriteOutputs(const screenshot::Image& pixels,
+                  const vector<string>& filenames,
+                  const screenshot::PngOptions& png_options,
+                  screenshot::RgbImage* image) {
+  // One result per file.  (vector<bool> can't be written concurrently.)
+  vector<char> succeeded(filenames.size(), true);
+  vector<thread> threads;
+  vector<size_t> converted_files;  // indexes into |filenames|
+  bool count_colors = false;
+  bool has_png_output = false;
+  for (size_t i = 0; i < filenames.size(); ++i) {
+    const OutputFormat format = GetOutputFormat(filenames[i]);
+    if (format == OUTPUT_TILES) {
+      threads.push_back(thread([&, i] {
+        succeeded[i] = WriteTileManifest(pixels, filenames[i], png_options);
+      }));
+      continue;
+    }
+    converted_files.push_back(i);
+    if (format == OUTPUT_PNG) {
+      has_png_output = true;
+      if (screenshot::MayUsePalette(png_options))
+        count_colors = true;
+    }
+  }
+
+  if (!converted_files.empty()) {
+    const uint64_t start_time_us = GetCurrentTimeUs();
+    screenshot::ConvertImage(pixels, count_colors, image);
+    VLOG(1) << "Converted pixels in " << GetCurrentTimeUs() - start_time_us
+            << " us";
+    const screenshot::PngOptions tuned_png_options =
+        FLAGS_auto_tune_ms > 0 && has_png_output ?
+        screenshot::TunePngOptions(*image, png_options,
+                                   FLAGS_auto_tune_ms * 1000LL) :
+        png_options;
+    for (size_t i = 1; i < converted_files.size(); ++i) {
+      const size_t file = converted_files[i];
+      threads.push_back(thread([&, file] {
+        succeeded[file] =
+            WriteOutput(*image, filenames[file], tuned_png_options);
+      }));
+    }
+    succeeded[converted_files[0]] =
+        WriteOutput(*image, filenames[converted_files[0]], tuned_png_options);
+  }
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+  return std::find(succeeded.begin(), succeeded.end(), false) ==
+         succeeded.end();
+}
+
+bool WriteOutputs(const screenshot::Image& pixels,
+                  const vector<string>& filenames,
+                  const screenshot::PngOptions& png_options) {
+  screenshot::RgbImage image;
+  return WriteOutputs(pixels, filenames, png_options, &image);
+}
+
+// Compare |pixels| against the PNG file named by --compare, printing the
+// result and writing a mask of the mismatched pixels to --diff_output if
+// requested.  Returns true if the images match within the tolerances.
+bool CompareToReference(const screenshot::Image& pixels) {
+  screenshot::RgbImage actual;
+  screenshot::ConvertImage(pixels, false, &actual);
+  screenshot::RgbImage expected;
+  CHECK(screenshot::ReadPngFile(FLAGS_compare, actual.channels, &expected))
+      << "Unable to read " << FLAGS_compare;
+  if (expected.width != actual.width || expected.height != actual.height) {
+    printf("Captured %dx%d image, but %s is %dx%d\n",
+           actual.width, actual.height, FLAGS_compare.c_str(),
+           expected.width, expected.height);
+    return false;
+  }
+
+  vector<unsigned char> mask;
+  const int64_t num_mismatches = screenshot::CompareImages(
+      actual, expected, FLAGS_compare_tolerance,
+      FLAGS_diff_output.empty() ? NULL : &mask);
+  printf("%lld of %lld pixels differ from %s\n",
+         static_cast<long long>(num_mismatches),
+         static_cast<long long>(actual.width) * actual.height,
+         FLAGS_compare.c_str());
+
+  if (!FLAGS_diff_output.empty()) {
+    // With just two colors, this gets written as a 1-bit indexed PNG.
+    screenshot::RgbImage diff;
+    diff.width = actual.width;
+    diff.height = actual.height;
+    diff.channels = 3;
+    diff.data.resize(diff.row_size() * diff.height);
+    for (size_t i = 0; i < mask.size(); ++i) {
+      const unsigned char value = mask[i] ? 0xff : 0;
+      diff.data[i * 3] = diff.data[i * 3 + 1] = diff.data[i * 3 + 2] = value;
+    }
+    diff.palette_valid = true;
+    diff.colors.push_back(0xff000000);
+    diff.colors.push_back(0xffffffff);
+    CHECK(WriteOutput(diff, FLAGS_diff_output, screenshot::PngOptions()));
+  }
+  return num_mismatches <= FLAGS_compare_max_mismatches;
+}
+
+// Fork a child process and return true in it, or false in the parent.  The
+// child starts a new session so that it outlives the caller, and points
+// stdin, stdout and stderr at /dev/null so that it doesn't hold the caller's
+// pipes open (glog still writes its log files).  Only one of the processes
+// may continue to use the X connection.
+bool ForkDetachedChild() {
+  const pid_t pid = fork();
+  PCHECK(pid >= 0) << "Unable to fork";
+  if (pid > 0)
+    return false;
+
+  setsid();
+  const int null_fd = open("/dev/null", O_RDWR);
+  if (null_fd >= 0) {
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    if (null_fd > STDERR_FILENO)
+      close(null_fd);
+  }
+  return true;
+}
+
+// Kinds of capture that --resident mode can be asked to perform.
+enum CaptureMode {
+  CAPTURE_SCREEN,
+  CAPTURE_WINDOW,
+  CAPTURE_REGION,
+};
+
+// A key combination grabbed in --resident mode.
+struct Hotkey {
+  CaptureMode mode;
+  KeyCode keycode;
+  unsigned int modifiers;
+};
+
+// Modifiers that shouldn't affect whether a hotkey matches.  Passive grabs
+// require an exact modifier match, so each hotkey is grabbed once for every
+// combination of these.
+static const unsigned int kIgnoredModifiers[] = {
+  0, LockMask, Mod2Mask, LockMask | Mod2Mask,  // Caps Lock and Num Lock
+};
+static const size_t kNumIgnoredModifiers =
+    sizeof(kIgnoredModifiers) / sizeof(kIgnoredModifiers[0]);
+
+// Set by HandleGrabKeyError().
+bool g_grab_key_failed = false;
+
+// Set by HandleCaptureError().
+bool g_capture_failed = false;
+
+// X error handler installed while grabbing hotkeys, which fails if another
+// client has already grabbed the same combination.
+int HandleGrabKeyError(Display* display, XErrorEvent* event) {
+  g_grab_key_failed = true;
+  return 0;
+}
+
+// X error handler installed during --resident captures, so that a window
+// disappearing at the wrong moment doesn't kill the process.
+int HandleCaptureError(Display* display, XErrorEvent* event) {
+  char message[256];
+  XGetErrorText(display, event->error_code, message, sizeof(message));
+  LOG(WARNING) << "X error during capture: " << message << " (request "
+               << static_cast<int>(event->request_code) << ")";
+  g_capture_failed = true;
+  return 0;
+}
+
+// Parse |spec|, a list of modifiers and a keysym name separated by '+'
+// (e.g. "Ctrl+Shift+Print"), into |hotkey|.  Returns false if it's invalid.
+bool ParseHotkey(Display* display, const string& spec, Hotkey* hotkey) {
+  istringstream input(spec);
+  vector<string> parts;
+  string part;
+  while (getline(input, part, '+'))
+    parts.push_back(part);
+  if (parts.empty())
+    return false;
+
+  hotkey->modifiers = 0;
+  for (size_t i = 0; i + 1 < parts.size(); ++i) {
+    string name = parts[i];
+    for (size_t j = 0; j < name.size(); ++j)
+      name[j] = tolower(name[j]);
+    if (name == "shift")
+      hotkey->modifiers |= ShiftMask;
+    else if (name == "ctrl" || name == "control")
+      hotkey->modifiers |= ControlMask;
+    else if (name == "alt" || name == "mod1")
+      hotkey->modifiers |= Mod1Mask;
+    else if (name == "super" || name == "mod4")
+      hotkey->modifiers |= Mod4Mask;
+    else
+      return false;
+  }
+
+  const KeySym keysym = XStringToKeysym(parts.back().c_str());
+  if (keysym == NoSymbol)
+    return false;
+  hotkey->keycode = XKeysymToKeycode(display, keysym);
+  return hotkey->keycode != 0;
+}
+
+// Expand strftime(3) conversions in |pattern| using the current local time.
+string FormatTimestampedFilename(const string& pattern) {
+  const time_t now = time(NULL);
+  struct tm local;
+  localtime_r(&now, &local);
+  char filename[PATH_MAX];
+  const size_t length =
+      strftime(filename, sizeof(filename), pattern.c_str(), &local);
+  return length > 0 ? string(filename, length) : pattern;
+}
+
+// Takes screenshots from a long-running process when hotkeys are pressed,
+// avoiding the cost of starting up and connecting to the X server for each
+// one.  Everything that can be set up ahead of time is: the region
+// selection window, a shared-memory capture buffer for the whole screen,
+// and the conversion buffer.
+class ResidentCapturer {
+ public:
+  ResidentCapturer(Display* display,
+                   const vector<string>& filename_patterns,
+                   const screenshot::PngOptions& png_options)
+      : display_(display),
+        root_(DefaultRootWindow(display)),
+        filename_patterns_(filename_patterns),
+        png_options_(png_options),
+        pool_(display, FLAGS_huge_pages),
+        selector_(display),
+        finder_(display) {
+    const int screen = DefaultScreen(display_);
+    screen_width_ = DisplayWidth(display_, screen);
+    screen_height_ = DisplayHeight(display_, screen);
+
+    // Named windows are looked up once and then cached until the window
+    // tree changes.
+    if (!FLAGS_window_name.empty() || !FLAGS_window_class.empty())
+      finder_.WatchForChanges();
+
+    // Capture the screen once so that the pool holds a segment that later
+    // screen, window and region captures can reuse, and the conversion
+    // buffer is allocated.
+    XImage* image = CaptureImage(&pool_, root_,
+                                 0, 0, screen_width_, screen_height_);
+    screenshot::ConvertImage(GetPixels(image, true), false, &rgb_image_);
+    pool_.Release(image);
+  }
+
+  // Grab the keys described by |spec| to perform captures of type |mode|.
+  // Does nothing if |spec| is empty.  Returns false if |spec| is invalid or
+  // another client has already grabbed the keys.
+  bool AddHotkey(const string& spec, CaptureMode mode) {
+    if (spec.empty())
+      return true;
+    Hotkey hotkey;
+    hotkey.mode = mode;
+    if (!ParseHotkey(display_, spec, &hotkey)) {
+      LOG(ERROR) << "Unable to parse hotkey \"" << spec << "\"";
+      return false;
+    }
+
+    g_grab_key_failed = false;
+    XErrorHandler old_handler = XSetErrorHandler(HandleGrabKeyError);
+    for (size_t i = 0; i < kNumIgnoredModifiers; ++i) {
+      XGrabKey(display_, hotkey.keycode,
+               hotkey.modifiers | kIgnoredModifiers[i],
+               root_,
+               False,          // owner_events
+               GrabModeAsync,  // pointer_mode
+               GrabModeAsync); // keyboard_mode
+    }
+    XSync(display_, False);
+    XSetErrorHandler(old_handler);
+    if (g_grab_key_failed) {
+      LOG(ERROR) << "Unable to grab hotkey \"" << spec << "\"; is another "
+                 << "program using it?";
+      return false;
+    }
+    hotkeys_.push_back(hotkey);
+    return true;
+  }
+
+  // Handle hotkey presses forever.
+  void Run() {
+    unsigned int ignored_modifiers = 0;
+    for (size_t i = 0; i < kNumIgnoredModifiers; ++i)
+      ignored_modifiers |= kIgnoredModifiers[i];
+
+    while (true) {
+      XEvent event;
+      XNextEvent(display_, &event);
+      finder_.HandleEvent(event);
+      if (event.type != KeyPress)
+        continue;
+      const unsigned int modifiers = event.xkey.state & ~ignored_modifiers;
+      for (size_t i = 0; i < hotkeys_.size(); ++i) {
+        if (hotkeys_[i].keycode == event.xkey.keycode &&
+            hotkeys_[i].modifiers == modifiers) {
+          Capture(hotkeys_[i].mode);
+          break;
+        }
+      }
+    }
+  }
+
+ private:
+  // Perform a single capture and write it to the output files.  X errors
+  // (e.g. from a window that's destroyed partway through) are logged rather
+  // than being fatal, and a failed capture is skipped.
+  void Capture(CaptureMode mode) {
+    XErrorHandler old_handler = XSetErrorHandler(HandleCaptureError);
+    g_capture_failed = false;
+    if (!CaptureAndWrite(mode))
+      LOG(WARNING) << "Skipping failed capture";
+    XSync(display_, False);
+    XSetErrorHandler(old_handler);
+  }
+
+  // Does the work for Capture(), returning false on failure.
+  bool CaptureAndWrite(CaptureMode mode) {
+    const uint64_t start_time_us = GetCurrentTimeUs();
+    Window win = root_;
+    int x = 0, y = 0;
+    unsigned int width = screen_width_, height = screen_height_;
+    switch (mode) {
+      case CAPTURE_SCREEN:
+        break;
+      case CAPTURE_WINDOW:
+        if (!FLAGS_window_name.empty() || !FLAGS_window_class.empty()) {
+          if (!GetNamedWindowRect(&win, &width, &height))
+            return false;
+        } else if (!GetActiveWindowRect(display_, &win,
+                                        &x, &y, &width, &height)) {
+          LOG(WARNING) << "Unable to find the active window";
+          return false;
+        }
+        break;
+      case CAPTURE_REGION:
+        // An aborted selection isn't a failure.
+        return !selector_.SelectRegion(&x, &y, &width, &height) ||
+               WriteCapture(root_, x, y, width, height, start_time_us);
+    }
+    return WriteCapture(win, x, y, width, height, start_time_us);
+  }
+
+  // Capture the |width|x|height| rectangle at (|x|, |y|) in |win| and write
+  // it to the output files.  Returns false on failure.
+  bool WriteCapture(Window win, int x, int y,
+                    unsigned int width, unsigned int height,
+                    uint64_t start_time_us) {
+    int root_x = 0, root_y = 0;
+    if (!ClipToScreen(win, &x, &y, &width, &height, &root_x, &root_y)) {
+      LOG(WARNING) << "Window 0x" << hex << win << std::dec
+                   << " is off-screen";
+      return false;
+    }
+    XImage* image = TryCaptureImage(&pool_, win, x, y, width, height);
+    XSync(display_, False);
+    if (g_capture_failed) {
+      if (image)
+        pool_.Release(image);
+      return false;
+    }
+    if (!image)
+      return false;
+    if (FLAGS_visual_feedback)
+      FlashVisualFeedback(display_, root_x, root_y, width, height);
+
+    vector<string> filenames;
+    for (size_t i = 0; i < filename_patterns_.size(); ++i)
+      filenames.push_back(FormatTimestampedFilename(filename_patterns_[i]));
+    screenshot::Image pixels = GetPixels(image, win == root_);
+    if (FLAGS_trim)
+      pixels = screenshot::TrimImage(pixels);
+    const bool written =
+        WriteOutputs(pixels, filenames, png_options_, &rgb_image_);
+    pool_.Release(image);
+    if (written) {
+      VLOG(1) << "Saved " << width << "x" << height << " capture to "
+              << filenames[0] << " in "
+              << (GetCurrentTimeUs() - start_time_us) / 1000 << " ms";
+    }
+    return written;
+  }
+
+  // Clip the |width|x|height| rectangle at (|x|, |y|) in |win| to the part
+  // that's on the screen, since XGetImage() fails for rectangles that
+  // aren't.  The clipped rectangle's position on the root is returned in
+  // |root_x| and |root_y|.  Returns false if none of it is on the screen.
+  bool ClipToScreen(Window win, int* x, int* y,
+                    unsigned int* width, unsigned int* height,
+                    int* root_x, int* root_y) {
+    int win_root_x = *x, win_root_y = *y;
+    Window child_ret = None;
+    if (win != root_ &&
+        !XTranslateCoordinates(display_, win, root_, *x, *y,
+                               &win_root_x, &win_root_y, &child_ret)) {
+      return false;
+    }
+    const int left = max(win_root_x, 0);
+    const int top = max(win_root_y, 0);
+    const int right =
+        min(win_root_x + static_cast<int>(*width), screen_width_);
+    const int bottom =
+        min(win_root_y + static_cast<int>(*height), screen_height_);
+    if (right <= left || bottom <= top)
+      return false;
+    *x += left - win_root_x;
+    *y += top - win_root_y;
+    *width = right - left;
+    *height = bottom - top;
+    *root_x = left;
+    *root_y = top;
+    return true;
+  }
+
+  // Look up the window matching --window_name or --window_class and get
+  // its size.  Returns false if there's no such window.
+  bool GetNamedWindowRect(Window* win,
+                          unsigned int* width, unsigned int* height) {
+    *win = FLAGS_window_name.empty() ?
+        finder_.FindByClass(FLAGS_window_class) :
+        finder_.FindByName(FLAGS_window_name);
+    if (*win == None) {
+      LOG(WARNING) << "No viewable window matching --window_name or "
+                   << "--window_class";
+      return false;
+    }
+    Window root_ret = None;
+    int x_ret = 0, y_ret = 0;
+    unsigned int border_width_ret = 0, depth_ret = 0;
+    return XGetGeometry(display_, *win, &root_ret, &x_ret, &y_ret,
+                        width, height, &border_width_ret, &depth_ret);
+  }
+
+  Display* display_;  // not owned
+  Window root_;
+  int screen_width_;
+  int screen_height_;
+  vector<string> filename_patterns_;
+  screenshot::PngOptions png_options_;
+
+  screenshot::CapturePool pool_;
+  RegionSelector selector_;
+  screenshot::WindowFinder finder_;
+  screenshot::RgbImage rgb_image_;
+
+  vector<Hotkey> hotkeys_;
+};
+
 }  // namespace
 
 int main(int argc, char** argv) {
   google::SetUsageMessage(kUsage);
   google::ParseCommandLineFlags(&argc, &argv, true);
-  if (argc != 2) {
+  vector<string> filenames;
+  if (argc == 2)
+    filenames.push_back(argv[1]);
+  if (!FLAGS_output.empty()) {
+    istringstream input(FLAGS_output);
+    string filename;
+    while (getline(input, filename, ','))
+      filenames.push_back(filename);
+  }
+  if (argc > 2 ||
+      (filenames.empty() && !FLAGS_clipboard && FLAGS_compare.empty())) {
     google::ShowUsageWithFlags(argv[0]);
     return 1;
   }
+  for (size_t i = 0; i < filenames.size(); ++i) {
+    // GetOutputFormat() crashes on unknown formats.
+    CHECK(GetOutputFormat(filenames[i]) != OUTPUT_TILES ||
+          !FLAGS_tile_store.empty())
+        << "--tile_store is needed to write " << filenames[i];
+  }
+  CHECK(!FLAGS_clipboard || FLAGS_frames <= 1)
+      << "--clipboard can't be used with --frames";
+  CHECK(FLAGS_frames <= 1 ||
+        (filenames.size() == 1 &&
+         GetOutputFormat(filenames[0]) == OUTPUT_PNG))
+      << "--frames requires a single PNG output file";
+  CHECK(FLAGS_compare.empty() || (FLAGS_frames <= 1 && !FLAGS_background))
+      << "--compare can't be used with --frames or --background";
+  CHECK(FLAGS_diff_output.empty() || !FLAGS_compare.empty())
+      << "--diff_output requires --compare";
+  CHECK(!FLAGS_freeze || FLAGS_region)
+      << "--freeze requires --region";
+  CHECK(FLAGS_wait_stable <= 0 || (FLAGS_frames <= 1 && !FLAGS_freeze))
+      << "--wait_stable can't be used with --frames or --freeze";
+  CHECK(!FLAGS_trim || FLAGS_frames <= 1)
+      << "--trim can't be used with --frames";
+  CHECK(FLAGS_auto_tune_ms <= 0 ||
+        (FLAGS_frames <= 1 && FLAGS_png_speed == "default"))
+      << "--auto_tune_ms can't be used with --frames or --png_speed";
+
+  // Pick the kernels' instruction set before any threads use them.
+  screenshot::CpuLevel cpu_level = screenshot::GetSupportedCpuLevel();
+  if (!FLAGS_cpu_level.empty()) {
+    CHECK(screenshot::ParseCpuLevel(FLAGS_cpu_level, &cpu_level))
+        << "Unknown --cpu_level value \"" << FLAGS_cpu_level << "\"";
+  }
+  screenshot::SetCpuLevel(cpu_level);
+  VLOG(1) << "Using " << screenshot::GetCpuLevelName(cpu_level) << " kernels";
+
+  screenshot::PngOptions png_options;
+  if (FLAGS_palette == "never") {
+    png_options.palette_mode = screenshot::PALETTE_NEVER;
+  } else {
+    CHECK(FLAGS_palette == "auto")
+        << "Unknown --palette value \"" << FLAGS_palette << "\"";
+  }
+  if (FLAGS_png_speed == "fastest") {
+    png_options.speed = screenshot::PNG_SPEED_FASTEST;
+  } else {
+    CHECK(FLAGS_png_speed == "default")
+        << "Unknown --png_speed value \"" << FLAGS_png_speed << "\"";
+  }
+
+  if (!FLAGS_reassemble.empty()) {
+    CHECK(!FLAGS_tile_store.empty()) << "--reassemble requires --tile_store";
+    CHECK(!FLAGS_clipboard) << "--clipboard can't be used with --reassemble";
+    string manifest;
+    CHECK(ReadFile(FLAGS_reassemble.c_str(), &manifest))
+        << "Unable to read " << FLAGS_reassemble;
+    screenshot::TileStore store(FLAGS_tile_store,
+                                png_options.compression_level);
+    vector<unsigned char> data;
+    screenshot::Image pixels;
+    CHECK(store.GetImage(manifest, &data, &pixels))
+        << "Unable to reassemble " << FLAGS_reassemble;
+    CHECK(WriteOutputs(pixels, filenames, png_options));
+    return 0;
+  }
 
   Display* display = XOpenDisplay(NULL);
   CHECK(display);
 
-  const char* filename = argv[1];
+  if (FLAGS_resident) {
+    CHECK(!filenames.empty()) << "--resident requires output files";
+    CHECK(!FLAGS_clipboard && !FLAGS_background && FLAGS_frames <= 1 &&
+          FLAGS_compare.empty() && FLAGS_geometry.empty() &&
+          FLAGS_wait_stable <= 0)
+        << "--resident can't be used with --clipboard, --background, "
+        << "--frames, --compare, --geometry, or --wait_stable";
+    CHECK(FLAGS_window.empty() && !FLAGS_active &&
+          (FLAGS_window_name.empty() || FLAGS_window_class.empty()))
+        << "--resident can only be used with one of --window_name and "
+        << "--window_class";
+    ResidentCapturer capturer(display, filenames, png_options);
+    if (!capturer.AddHotkey(FLAGS_hotkey_screen, CAPTURE_SCREEN) ||
+        !capturer.AddHotkey(FLAGS_hotkey_window, CAPTURE_WINDOW) ||
+        !capturer.AddHotkey(FLAGS_hotkey_region, CAPTURE_REGION)) {
+      return 1;
+    }
+    capturer.Run();
+    return 0;
+  }
+
+  CHECK(!FLAGS_window.empty() + !FLAGS_window_name.empty() +
+        !FLAGS_window_class.empty() + FLAGS_active <= 1)
+      << "Only one of --window, --window_name, --window_class, and --active "
+      << "may be passed";
 
   Window win = None;
-  if (FLAGS_window.empty() || FLAGS_region) {
+  int active_x = 0, active_y = 0;
+  unsigned int active_width = 0, active_height = 0;
+  if (FLAGS_region) {
     win = DefaultRootWindow(display);
-  } else {
+  } else if (FLAGS_active) {
+    CHECK(GetActiveWindowRect(display, &win, &active_x, &active_y,
+                              &active_width, &active_height))
+        << "Unable to find the active window";
+  } else if (!FLAGS_window.empty()) {
     istringstream input(FLAGS_window);
     CHECK(!(input >> hex >> win).fail())
         << "Unable to parse \"" << FLAGS_window << "\" as window "
         << "(should be hexadecimal X ID)";
+  } else if (!FLAGS_window_name.empty()) {
+    screenshot::WindowFinder finder(display);
+    win = finder.FindByName(FLAGS_window_name);
+    CHECK(win != None)
+        << "No viewable window named \"" << FLAGS_window_name << "\"";
+  } else if (!FLAGS_window_class.empty()) {
+    screenshot::WindowFinder finder(display);
+    win = finder.FindByClass(FLAGS_window_class);
+    CHECK(win != None)
+        << "No viewable window with class \"" << FLAGS_window_class << "\"";
+  } else {
+    win = DefaultRootWindow(display);
   }
 
   int shot_x = 0, shot_y = 0;
@@ -377,42 +1788,131 @@ int main(int argc, char** argv) {
                      &x_ret, &y_ret,
                      &shot_width, &shot_height,
                      &border_width_ret, &depth_ret));
+  if (FLAGS_active && !FLAGS_region) {
+    CHECK(FLAGS_geometry.empty()) << "--geometry can't be used with --active";
+    shot_x = active_x;
+    shot_y = active_y;
+    shot_width = active_width;
+    shot_height = active_height;
+  }
+  if (!FLAGS_geometry.empty()) {
+    CHECK(!FLAGS_region) << "--geometry can't be used with --region";
+    CHECK(ApplyGeometry(FLAGS_geometry,
+                        &shot_x, &shot_y, &shot_width, &shot_height))
+        << "Geometry \"" << FLAGS_geometry << "\" is invalid or lies "
+        << "outside of the " << shot_width << "x" << shot_height
+        << " drawable";
+  }
+  // Windows with 32-bit visuals have meaningful alpha, but the screen
+  // doesn't.
+  const bool force_opaque = win == DefaultRootWindow(display);
+
+  screenshot::CapturePool* pool =
+      new screenshot::CapturePool(display, FLAGS_huge_pages);
+
+  // With --freeze, this holds the entire screen rather than just the region
+  // being captured, and |frozen| is set.
+  XImage* image = NULL;
+  bool frozen = false;
+
   if (FLAGS_region) {
+    Window frozen_win = None;
+    if (FLAGS_freeze) {
+      CHECK(FLAGS_frames <= 1) << "--freeze can't be used with --frames";
+      image = CaptureImage(pool, win, 0, 0, shot_width, shot_height);
+      frozen = true;
+      frozen_win = CreateFrozenScreenWindow(display, image);
+      XMapWindow(display, frozen_win);
+    }
+
     RegionSelector selector(display);
-    if (!selector.SelectRegion(&shot_x, &shot_y, &shot_width, &shot_height))
+    const bool selected =
+        selector.SelectRegion(&shot_x, &shot_y, &shot_width, &shot_height);
+    if (frozen_win != None)
+      XDestroyWindow(display, frozen_win);
+    if (!selected)
       return 1;
+
+    if (frozen) {
+      shot_width =
+          min(shot_width, static_cast<unsigned int>(image->width - shot_x));
+      shot_height =
+          min(shot_height, static_cast<unsigned int>(image->height - shot_y));
+    }
   }
 
-  XImage* image = XGetImage(display, win,
-                            shot_x, shot_y,
-                            shot_width, shot_height,
-                            AllPlanes, ZPixmap);
-  CHECK(image);
-  CHECK(image->depth == 24 || image->depth == 32)
-      << "Unsupported image depth " << image->depth;
+  if (FLAGS_frames > 1) {
+    CHECK(RecordAnimation(pool, win,
+                          shot_x, shot_y, shot_width, shot_height,
+                          force_opaque, filenames[0].c_str(), png_options))
+        << "Unable to write " << filenames[0];
+  } else if (!image && FLAGS_wait_stable > 0) {
+    image = CaptureStableImage(pool, win,
+                               shot_x, shot_y, shot_width, shot_height,
+                               FLAGS_wait_stable, FLAGS_wait_stable_timeout_ms);
+  } else if (!image) {
+    image = CaptureImage(pool, win,
+                         shot_x, shot_y, shot_width, shot_height);
+  }
 
-  Window visual_feedback_win =
-      CreateVisualFeedbackWindow(
-          display, shot_x, shot_y, shot_width, shot_height);
-  XMapWindow(display, visual_feedback_win);
-  XFlush(display);
+  screenshot::Image pixels;
+  if (image) {
+    pixels = GetPixels(image, force_opaque);
+    if (frozen)
+      pixels = pixels.GetRegion(shot_x, shot_y, shot_width, shot_height);
+    if (FLAGS_trim) {
+      pixels = screenshot::TrimImage(pixels);
+      VLOG(1) << "Trimmed capture to " << pixels.width << "x"
+              << pixels.height;
+    }
 
-  usleep(kVisualFeedbackWindowDisplayTimeMs * 1000);
-  XDestroyWindow(display, visual_feedback_win);
-  XFlush(display);
+    // Leave encoding and writing to a child process so that whoever started
+    // us can continue as soon as we're done with the X server.
+    if (FLAGS_background && !FLAGS_clipboard && ForkDetachedChild()) {
+      close(ConnectionNumber(display));
+      CHECK(WriteOutputs(pixels, filenames, png_options));
+      return 0;
+    }
+  }
+
+  if (FLAGS_visual_feedback) {
+    // The shot's position is relative to |win|, but the feedback window is
+    // placed on the root.
+    const Window root = DefaultRootWindow(display);
+    int root_x = shot_x, root_y = shot_y;
+    Window child_ret = None;
+    if (win == root ||
+        XTranslateCoordinates(display, win, root, shot_x, shot_y,
+                              &root_x, &root_y, &child_ret)) {
+      FlashVisualFeedback(display, root_x, root_y, shot_width, shot_height);
+    }
+  }
 
-  cairo_surface_t* surface =
-      cairo_image_surface_create_for_data(
-          reinterpret_cast<unsigned char*>(image->data),
-          image->depth == 24 ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
-          image->width,
-          image->height,
-          image->bytes_per_line);
-  CHECK(surface) << "Unable to create Cairo surface from XImage data";
-  CHECK(cairo_surface_write_to_png(surface, filename) == CAIRO_STATUS_SUCCESS);
-  cairo_surface_destroy(surface);
-  XDestroyImage(image);
+  int exit_code = 0;
+  if (image && !FLAGS_compare.empty() && !CompareToReference(pixels))
+    exit_code = kCompareFailedExitCode;
 
+  if (image) {
+    if (FLAGS_clipboard) {
+      CHECK(WriteOutputs(pixels, filenames, png_options));
+      screenshot::ClipboardServer clipboard(display, pixels, png_options);
+      CHECK(clipboard.TakeOwnership())
+          << "Unable to take ownership of the CLIPBOARD selection";
+      XSync(display, False);
+
+      // Serve the selection from a child process so that whoever started us
+      // can continue.  The parent leaves without closing the X connection,
+      // which the child is still using.
+      if (!ForkDetachedChild())
+        _exit(exit_code);
+      clipboard.Run();
+    } else if (!FLAGS_background) {
+      CHECK(WriteOutputs(pixels, filenames, png_options));
+    }
+    pool->Release(image);
+  }
+
+  delete pool;
   XCloseDisplay(display);
-  return 0;
+  return exit_code;
 }
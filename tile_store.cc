@@ -0,0 +1,254 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tile_store.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+using std::istringstream;
+using std::min;
+using std::ostringstream;
+using std::string;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// First line of each manifest, followed by the format version.  Version 1
+// manifests, which named tiles by a 128-bit non-cryptographic hash, can
+// still be read.
+static const char kManifestMagic[] = "screenshot-tiles";
+static const int kManifestVersion = 2;
+static const int kOldManifestVersion = 1;
+
+// Number of hex digits in a tile hash, and in a version 1 manifest's hashes.
+static const size_t kHashLength = 64;
+static const size_t kOldHashLength = 32;
+
+// Largest image dimension that we'll accept in a manifest.
+static const int kMaxDimension = 1 << 15;
+
+// Returns the SHA-256 digest of the |width|x|height| tile |pixels| (and
+// its dimensions and alpha flag) as hex digits.  Tiles are deduplicated on
+// the digest alone, so it needs to be collision-resistant even against
+// crafted content.
+string HashTile(const vector<uint32_t>& pixels, int width, int height,
+                bool has_alpha) {
+  const uint32_t header[3] = {
+    static_cast<uint32_t>(width), static_cast<uint32_t>(height), has_alpha,
+  };
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_size = 0;
+  EVP_MD_CTX* context = EVP_MD_CTX_new();
+  CHECK(context &&
+        EVP_DigestInit_ex(context, EVP_sha256(), NULL) &&
+        EVP_DigestUpdate(context, header, sizeof(header)) &&
+        EVP_DigestUpdate(context, &pixels[0],
+                         pixels.size() * sizeof(uint32_t)) &&
+        EVP_DigestFinal_ex(context, digest, &digest_size));
+  EVP_MD_CTX_free(context);
+  CHECK_EQ(digest_size * 2, kHashLength);
+
+  static const char kHexDigits[] = "0123456789abcdef";
+  string hex(kHashLength, '0');
+  for (unsigned int i = 0; i < digest_size; ++i) {
+    hex[i * 2] = kHexDigits[digest[i] >> 4];
+    hex[i * 2 + 1] = kHexDigits[digest[i] & 0xf];
+  }
+  return hex;
+}
+
+// Creates the directory at |path| if it doesn't already exist.
+bool MakeDirectory(const string& path) {
+  return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+// Reads the file at |path| into |contents|, returning false on failure.
+bool ReadFileToString(const string& path, string* contents) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  contents->clear();
+  char buffer[64 * 1024];
+  size_t bytes_read = 0;
+  while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    contents->append(buffer, bytes_read);
+  const bool success = !ferror(file);
+  fclose(file);
+  return success;
+}
+
+}  // namespace
+
+TileStore::TileStore(const string& dir, int compression_level)
+    : dir_(dir),
+      compression_level_(compression_level),
+      num_tiles_written_(0),
+      num_tiles_reused_(0) {
+}
+
+bool TileStore::AddImage(const Image& image, int tile_size,
+                         string* manifest) {
+  CHECK_GT(tile_size, 0);
+  if (!MakeDirectory(dir_))
+    return false;
+
+  ostringstream output;
+  output << kManifestMagic << " " << kManifestVersion << " "
+         << image.width << " " << image.height << " " << tile_size << " "
+         << image.has_alpha << "\n";
+
+  // When there's no alpha channel, the top byte of each pixel is undefined,
+  // so make it opaque before hashing to keep identical tiles identical.
+  const uint32_t alpha_mask = image.has_alpha ? 0 : 0xff000000;
+  vector<uint32_t> pixels;
+  vector<unsigned char> compressed;
+  for (int tile_y = 0; tile_y < image.height; tile_y += tile_size) {
+    const int height = min(tile_size, image.height - tile_y);
+    for (int tile_x = 0; tile_x < image.width; tile_x += tile_size) {
+      const int width = min(tile_size, image.width - tile_x);
+      pixels.resize(width * height);
+      for (int y = 0; y < height; ++y) {
+        const uint32_t* row = image.Row(tile_y + y) + tile_x;
+        uint32_t* out = &pixels[y * width];
+        for (int x = 0; x < width; ++x)
+          out[x] = row[x] | alpha_mask;
+      }
+
+      const string hash = HashTile(pixels, width, height, image.has_alpha);
+      output << hash << "\n";
+      const string path = GetTilePath(hash);
+      if (access(path.c_str(), F_OK) == 0) {
+        num_tiles_reused_++;
+        continue;
+      }
+
+      const uLong size = pixels.size() * sizeof(uint32_t);
+      uLongf compressed_size = compressBound(size);
+      compressed.resize(compressed_size);
+      if (compress2(&compressed[0], &compressed_size,
+                    reinterpret_cast<const Bytef*>(&pixels[0]), size,
+                    compression_level_) != Z_OK ||
+          !WriteTile(path, &compressed[0], compressed_size)) {
+        LOG(ERROR) << "Unable to write tile " << path;
+        return false;
+      }
+      num_tiles_written_++;
+    }
+  }
+  manifest->append(output.str());
+  return true;
+}
+
+bool TileStore::GetImage(const string& manifest,
+                         vector<unsigned char>* pixels,
+                         Image* image) {
+  istringstream input(manifest);
+  string magic;
+  int version = 0, width = 0, height = 0, tile_size = 0;
+  bool has_alpha = false;
+  if (!(input >> magic >> version >> width >> height >> tile_size
+              >> has_alpha) ||
+      magic != kManifestMagic ||
+      (version != kManifestVersion && version != kOldManifestVersion)) {
+    LOG(ERROR) << "Not a tile manifest";
+    return false;
+  }
+  if (width <= 0 || height <= 0 || tile_size <= 0 ||
+      width > kMaxDimension || height > kMaxDimension) {
+    LOG(ERROR) << "Bad dimensions in tile manifest";
+    return false;
+  }
+
+  const size_t hash_length =
+      version == kOldManifestVersion ? kOldHashLength : kHashLength;
+  const int stride = width * sizeof(uint32_t);
+  pixels->assign(static_cast<size_t>(stride) * height, 0);
+  vector<uint32_t> tile;
+  string compressed;
+  for (int tile_y = 0; tile_y < height; tile_y += tile_size) {
+    const int tile_height = min(tile_size, height - tile_y);
+    for (int tile_x = 0; tile_x < width; tile_x += tile_size) {
+      const int tile_width = min(tile_size, width - tile_x);
+      string hash;
+      if (!(input >> hash) || hash.size() != hash_length ||
+          hash.find_first_not_of("0123456789abcdef") != string::npos) {
+        LOG(ERROR) << "Missing or malformed tile hash in manifest";
+        return false;
+      }
+      const string path = GetTilePath(hash);
+      if (!ReadFileToString(path, &compressed)) {
+        LOG(ERROR) << "Unable to read tile " << path;
+        return false;
+      }
+
+      tile.resize(static_cast<size_t>(tile_width) * tile_height);
+      uLongf size = tile.size() * sizeof(uint32_t);
+      if (uncompress(reinterpret_cast<Bytef*>(&tile[0]), &size,
+                     reinterpret_cast<const Bytef*>(compressed.data()),
+                     compressed.size()) != Z_OK ||
+          size != tile.size() * sizeof(uint32_t)) {
+        LOG(ERROR) << "Corrupt tile " << path;
+        return false;
+      }
+      for (int y = 0; y < tile_height; ++y) {
+        memcpy(&(*pixels)[static_cast<size_t>(tile_y + y) * stride +
+                          tile_x * sizeof(uint32_t)],
+               &tile[static_cast<size_t>(y) * tile_width],
+               tile_width * sizeof(uint32_t));
+      }
+    }
+  }
+
+  image->data = &(*pixels)[0];
+  image->width = width;
+  image->height = height;
+  image->stride = stride;
+  image->has_alpha = has_alpha;
+  return true;
+}
+
+string TileStore::GetTilePath(const string& hash) const {
+  return dir_ + "/" + hash.substr(0, 2) + "/" + hash.substr(2);
+}
+
+bool TileStore::WriteTile(const string& path, const unsigned char* data,
+                          size_t size) {
+  if (!MakeDirectory(path.substr(0, path.rfind('/'))))
+    return false;
+
+  ostringstream temp_path;
+  temp_path << path << ".tmp." << getpid() << "." << this;
+  FILE* file = fopen(temp_path.str().c_str(), "wb");
+  if (!file)
+    return false;
+  const bool written = fwrite(data, 1, size, file) == size;
+  if (fclose(file) != 0 || !written ||
+      rename(temp_path.str().c_str(), path.c_str()) != 0) {
+    unlink(temp_path.str().c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace screenshot
@@ -0,0 +1,61 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_TILE_STORE_H_
+#define SCREENSHOT_TILE_STORE_H_
+
+#include <string>
+#include <vector>
+
+#include "image.h"
+
+namespace screenshot {
+
+// Stores images as grids of square tiles in a content-addressed directory,
+// so that tiles shared between images (e.g. periodic shots of a mostly
+// static desktop) are only written once.  Each image is described by a
+// small text manifest listing the SHA-256 digests of its tiles.
+//
+// Tiles are stored as zlib-compressed 0xAARRGGBB pixels in native byte
+// order, under "<dir>/<first two hex digits of hash>/<remaining digits>".
+class TileStore {
+ public:
+  // |compression_level| is the zlib level used for new tiles.
+  TileStore(const std::string& dir, int compression_level);
+
+  int num_tiles_written() const { return num_tiles_written_; }
+  int num_tiles_reused() const { return num_tiles_reused_; }
+
+  // Splits |image| into |tile_size|x|tile_size| tiles (smaller at the right
+  // and bottom edges), adds the ones that aren't already in the store, and
+  // appends the image's manifest to |manifest|.  Returns false on failure.
+  bool AddImage(const Image& image, int tile_size, std::string* manifest);
+
+  // Rebuilds the image described by |manifest|, storing its pixels in
+  // |pixels| and pointing |image| at them.  Returns false if the manifest is
+  // malformed or refers to missing or corrupt tiles.
+  bool GetImage(const std::string& manifest,
+                std::vector<unsigned char>* pixels,
+                Image* image);
+
+ private:
+  // Returns the path of the tile with hash |hash|, a string of hex digits.
+  std::string GetTilePath(const std::string& hash) const;
+
+  // Writes |size| bytes of compressed tile data to |path|.  The data is
+  // written to a temporary file and renamed into place, so concurrent
+  // writers never leave partial tiles.
+  bool WriteTile(const std::string& path, const unsigned char* data,
+                 size_t size);
+
+  std::string dir_;
+  int compression_level_;
+
+  int num_tiles_written_;
+  int num_tiles_reused_;
+};
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_TILE_STORE_H_
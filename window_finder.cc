@@ -0,0 +1,278 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "window_finder.h"
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include <X11/Xatom.h>
+#ifdef USE_XCB
+#include <xcb/xcb.h>
+#endif
+
+#ifdef USE_GLOG
+#include <glog/logging.h>
+#else
+#include "base/logging.h"
+#endif
+
+using std::string;
+using std::vector;
+
+namespace screenshot {
+
+namespace {
+
+// Longest property value that we'll read, in bytes.  Titles and class
+// names are much shorter than this in practice.
+static const long kMaxPropertyLength = 1024;
+
+// X error handler installed while walking the tree with Xlib.  Windows may
+// be destroyed while we're looking at them, which shouldn't be fatal.
+int HandleWindowFinderError(Display* display, XErrorEvent* event) {
+  return 0;
+}
+
+#ifdef USE_XCB
+// Returns the value of the property requested by |cookie| as a string, or
+// an empty string if it isn't set.
+string GetXcbPropertyReply(xcb_connection_t* connection,
+                           xcb_get_property_cookie_t cookie) {
+  xcb_generic_error_t* error = NULL;
+  xcb_get_property_reply_t* reply =
+      xcb_get_property_reply(connection, cookie, &error);
+  free(error);
+  string value;
+  if (reply && reply->format == 8) {
+    value.assign(static_cast<const char*>(xcb_get_property_value(reply)),
+                 xcb_get_property_value_length(reply));
+  }
+  free(reply);
+  return value;
+}
+#endif
+
+}  // namespace
+
+WindowFinder::WindowFinder(Display* display)
+    : display_(display),
+#ifdef USE_XCB
+      xcb_connection_(xcb_connect(DisplayString(display), NULL)),
+#endif
+      net_wm_name_atom_(XInternAtom(display_, "_NET_WM_NAME", False)) {
+#ifdef USE_XCB
+  if (xcb_connection_has_error(xcb_connection_)) {
+    LOG(WARNING) << "Unable to open XCB connection; searching with Xlib";
+    xcb_disconnect(xcb_connection_);
+    xcb_connection_ = NULL;
+  }
+#endif
+}
+
+WindowFinder::~WindowFinder() {
+#ifdef USE_XCB
+  if (xcb_connection_)
+    xcb_disconnect(xcb_connection_);
+#endif
+}
+
+Window WindowFinder::FindByName(const string& name) {
+  return Find(Query(QUERY_NAME, name));
+}
+
+Window WindowFinder::FindByClass(const string& window_class) {
+  return Find(Query(QUERY_CLASS, window_class));
+}
+
+void WindowFinder::WatchForChanges() {
+  // Add to our existing selection on the root window rather than replacing
+  // it.
+  Window root = DefaultRootWindow(display_);
+  XWindowAttributes attr;
+  CHECK(XGetWindowAttributes(display_, root, &attr));
+  XSelectInput(display_, root, attr.your_event_mask | SubstructureNotifyMask);
+}
+
+void WindowFinder::HandleEvent(const XEvent& event) {
+  if (event.type == MapNotify || event.type == UnmapNotify ||
+      event.type == DestroyNotify) {
+    if (!cache_.empty())
+      VLOG(1) << "Window tree changed; dropping cached window lookups";
+    cache_.clear();
+  }
+}
+
+Window WindowFinder::Find(const Query& query) {
+  std::map<Query, Window>::const_iterator it = cache_.find(query);
+  if (it != cache_.end())
+    return it->second;
+
+  Window win = Search(query);
+  VLOG(1) << "Found window 0x" << std::hex << win << std::dec
+          << " for \"" << query.second << "\"";
+  // Don't cache misses; the window may just not have been mapped yet.
+  if (win != None)
+    cache_[query] = win;
+  return win;
+}
+
+// static
+bool WindowFinder::Matches(const Query& query,
+                           const string& net_wm_name,
+                           const string& wm_name,
+                           const string& wm_class) {
+  if (query.second.empty())
+    return false;
+
+  if (query.first == QUERY_NAME)
+    return net_wm_name == query.second || wm_name == query.second;
+
+  // WM_CLASS holds the instance and class names, each NUL-terminated.
+  const size_t instance_end = wm_class.find('\0');
+  if (instance_end == string::npos)
+    return false;
+  const string instance_name = wm_class.substr(0, instance_end);
+  const size_t class_end = wm_class.find('\0', instance_end + 1);
+  const string class_name = wm_class.substr(
+      instance_end + 1,
+      class_end == string::npos ? string::npos : class_end - instance_end - 1);
+  return instance_name == query.second || class_name == query.second;
+}
+
+// Both searches go breadth-first, since client windows are either children
+// of the root or (under reparenting window managers) grandchildren.  Within
+// a level, windows are visited from the bottom of the stacking order to the
+// top, so the last match is the topmost one.
+Window WindowFinder::Search(const Query& query) {
+#ifdef USE_XCB
+  if (xcb_connection_)
+    return SearchWithXcb(query);
+#endif
+
+  XErrorHandler old_handler = XSetErrorHandler(HandleWindowFinderError);
+  Window match = None;
+  vector<Window> level(1, DefaultRootWindow(display_));
+  while (match == None && !level.empty()) {
+    vector<Window> next_level;
+    for (vector<Window>::const_iterator it = level.begin();
+         it != level.end(); ++it) {
+      if (Matches(query,
+                  GetStringProperty(*it, net_wm_name_atom_),
+                  GetStringProperty(*it, XA_WM_NAME),
+                  GetStringProperty(*it, XA_WM_CLASS))) {
+        XWindowAttributes attr;
+        if (XGetWindowAttributes(display_, *it, &attr) &&
+            attr.map_state == IsViewable) {
+          match = *it;
+        }
+      }
+      // There's no need to descend any further once we've found a match.
+      if (match != None)
+        continue;
+
+      Window root_ret = None, parent_ret = None;
+      Window* children = NULL;
+      unsigned int num_children = 0;
+      if (XQueryTree(display_, *it, &root_ret, &parent_ret,
+                     &children, &num_children)) {
+        next_level.insert(next_level.end(), children, children + num_children);
+      }
+      if (children)
+        XFree(children);
+    }
+    level.swap(next_level);
+  }
+  XSync(display_, False);
+  XSetErrorHandler(old_handler);
+  return match;
+}
+
+#ifdef USE_XCB
+Window WindowFinder::SearchWithXcb(const Query& query) {
+  xcb_connection_t* conn = xcb_connection_;
+  Window match = None;
+  vector<xcb_window_t> level(1, DefaultRootWindow(display_));
+  while (match == None && !level.empty()) {
+    // Send every request for this level before reading any replies.
+    const size_t num_windows = level.size();
+    vector<xcb_get_property_cookie_t> net_wm_name_cookies(num_windows);
+    vector<xcb_get_property_cookie_t> wm_name_cookies(num_windows);
+    vector<xcb_get_property_cookie_t> wm_class_cookies(num_windows);
+    vector<xcb_get_window_attributes_cookie_t> attr_cookies(num_windows);
+    vector<xcb_query_tree_cookie_t> tree_cookies(num_windows);
+    for (size_t i = 0; i < num_windows; ++i) {
+      net_wm_name_cookies[i] =
+          xcb_get_property(conn, 0, level[i], net_wm_name_atom_,
+                           XCB_GET_PROPERTY_TYPE_ANY,
+                           0, kMaxPropertyLength / 4);
+      wm_name_cookies[i] =
+          xcb_get_property(conn, 0, level[i], XCB_ATOM_WM_NAME,
+                           XCB_GET_PROPERTY_TYPE_ANY,
+                           0, kMaxPropertyLength / 4);
+      wm_class_cookies[i] =
+          xcb_get_property(conn, 0, level[i], XCB_ATOM_WM_CLASS,
+                           XCB_GET_PROPERTY_TYPE_ANY,
+                           0, kMaxPropertyLength / 4);
+      attr_cookies[i] = xcb_get_window_attributes(conn, level[i]);
+      tree_cookies[i] = xcb_query_tree(conn, level[i]);
+    }
+    xcb_flush(conn);
+
+    vector<xcb_window_t> next_level;
+    for (size_t i = 0; i < num_windows; ++i) {
+      const bool matches =
+          Matches(query,
+                  GetXcbPropertyReply(conn, net_wm_name_cookies[i]),
+                  GetXcbPropertyReply(conn, wm_name_cookies[i]),
+                  GetXcbPropertyReply(conn, wm_class_cookies[i]));
+
+      xcb_generic_error_t* error = NULL;
+      xcb_get_window_attributes_reply_t* attr =
+          xcb_get_window_attributes_reply(conn, attr_cookies[i], &error);
+      free(error);
+      if (matches && attr && attr->map_state == XCB_MAP_STATE_VIEWABLE)
+        match = level[i];
+      free(attr);
+
+      error = NULL;
+      xcb_query_tree_reply_t* tree =
+          xcb_query_tree_reply(conn, tree_cookies[i], &error);
+      free(error);
+      if (tree) {
+        const xcb_window_t* children = xcb_query_tree_children(tree);
+        next_level.insert(next_level.end(), children,
+                          children + xcb_query_tree_children_length(tree));
+      }
+      free(tree);
+    }
+    level.swap(next_level);
+  }
+  return match;
+}
+#endif
+
+string WindowFinder::GetStringProperty(Window win, Atom property) {
+  Atom type = None;
+  int format = 0;
+  unsigned long num_items = 0, bytes_after = 0;
+  unsigned char* data = NULL;
+  if (XGetWindowProperty(display_, win, property,
+                         0, kMaxPropertyLength / 4,  // offset, length
+                         False,                      // delete
+                         AnyPropertyType,
+                         &type, &format, &num_items, &bytes_after,
+                         &data) != Success) {
+    return string();
+  }
+  string value;
+  if (data && format == 8)
+    value.assign(reinterpret_cast<const char*>(data), num_items);
+  if (data)
+    XFree(data);
+  return value;
+}
+
+}  // namespace screenshot
@@ -0,0 +1,90 @@
+// Copyright (c) 2009 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SCREENSHOT_WINDOW_FINDER_H_
+#define SCREENSHOT_WINDOW_FINDER_H_
+
+#include <map>
+#include <string>
+#include <utility>
+
+#include <X11/Xlib.h>
+
+#ifdef USE_XCB
+struct xcb_connection_t;
+#endif
+
+namespace screenshot {
+
+// Finds windows by title or WM_CLASS.  The window tree is walked breadth-
+// first, one level at a time; when built with XCB, every request for a
+// level is sent before any reply is read, so a walk costs one round trip
+// per level of the tree rather than several per window.  Results are
+// cached until HandleEvent() sees a window get mapped, unmapped or
+// destroyed.
+class WindowFinder {
+ public:
+  explicit WindowFinder(Display* display);
+  ~WindowFinder();
+
+  // Returns the topmost viewable window whose _NET_WM_NAME or WM_NAME is
+  // |name|, or None if there isn't one.
+  Window FindByName(const std::string& name);
+
+  // Returns the topmost viewable window whose WM_CLASS instance or class
+  // name is |window_class|, or None if there isn't one.
+  Window FindByClass(const std::string& window_class);
+
+  // Selects the root window events that HandleEvent() uses to keep the
+  // cache up to date.  Only long-running callers need this.
+  void WatchForChanges();
+
+  // Drops cached results if |event| is a MapNotify, UnmapNotify or
+  // DestroyNotify.
+  void HandleEvent(const XEvent& event);
+
+ private:
+  enum QueryType {
+    QUERY_NAME,
+    QUERY_CLASS,
+  };
+  typedef std::pair<QueryType, std::string> Query;
+
+  // Returns the cached result for |query|, searching if there isn't one.
+  Window Find(const Query& query);
+
+  // Does |query| match a window with the passed property values?  Empty
+  // strings are used for missing properties.
+  static bool Matches(const Query& query,
+                      const std::string& net_wm_name,
+                      const std::string& wm_name,
+                      const std::string& wm_class);
+
+  // Walks the window tree looking for a match for |query|.
+  Window Search(const Query& query);
+#ifdef USE_XCB
+  Window SearchWithXcb(const Query& query);
+#endif
+
+  // Returns the value of |property| on |win| as a string, or an empty
+  // string if it isn't set.
+  std::string GetStringProperty(Window win, Atom property);
+
+  Display* display_;  // not owned
+
+#ifdef USE_XCB
+  // Separate connection used for pipelined requests.  Window IDs are global
+  // to the server, so it can look at the same windows as |display_|.  NULL
+  // if the connection couldn't be opened.
+  xcb_connection_t* xcb_connection_;
+#endif
+
+  Atom net_wm_name_atom_;
+
+  std::map<Query, Window> cache_;
+};
+
+}  // namespace screenshot
+
+#endif  // SCREENSHOT_WINDOW_FINDER_H_